@@ -0,0 +1,422 @@
+#pragma once
+#include "CommitTree.h"
+
+// Alternative commit index: a partially persistent B+-tree. It exposes the same contract as the AVL
+// engine in CommitTree.h (insertNode / searchCommit / getSuccessor / getPredecessor / buildCommitTree
+// taking a version), so code written as a template over the tree type runs on either engine;
+// checkCommitEngine in CommitChecks.cpp is such code, and compares the two on the same history.
+// Where the AVL pays one cache miss per level (~17 levels at 100k commits), the B+-tree has 16-way
+// pages whose key arrays fill one cache line, and is 4-5 levels deep for the same history.
+//
+// Persistence is by path copying: a page created for the version being written is updated in place,
+// any older page on the insert path is copied first. Each version records its own root.
+
+
+// Keys per page, picked so count + keys of an inner page fill exactly one 64-byte cache line
+const int BTREE_MAX_KEYS = 15;
+
+
+// A commit as stored in a leaf page. searchCommit and friends return pointers to these
+struct CommitEntry {
+    int commitCounter;
+    uint32_t payload;   // index into the tree's CommitPayloadStore
+};
+
+
+// Inner page: children[i] holds the keys below keys[i], children[count] holds the rest.
+// keys[i] is the smallest commit number in children[i + 1].
+struct BTreeInner {
+    int count;
+    int keys[BTREE_MAX_KEYS];
+    uint32_t children[BTREE_MAX_KEYS + 1];
+    int version;        // version that created this page
+};
+
+
+// Leaf page: up to BTREE_MAX_KEYS commits in ascending order
+struct BTreeLeaf {
+    int count;
+    int version;
+    CommitEntry entries[BTREE_MAX_KEYS];
+};
+
+
+// Chunked pool with stable 32-bit page handles, same layout idea as CommitArena
+template <typename T>
+struct BTreePagePool {
+    static const uint32_t CHUNK_BITS = 10;
+    static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+
+    std::vector<std::unique_ptr<T[]>> chunks;
+    uint32_t count;
+
+    BTreePagePool() : count(0) {}
+
+    uint32_t allocate() {
+        if ((count & (CHUNK_SIZE - 1)) == 0)
+            chunks.emplace_back(new T[CHUNK_SIZE]);
+        return ++count;   // handle = index + 1, 0 is the null page
+    }
+
+    T& operator[](uint32_t ref) { return chunks[(ref - 1) >> CHUNK_BITS][(ref - 1) & (CHUNK_SIZE - 1)]; }
+    const T& operator[](uint32_t ref) const { return chunks[(ref - 1) >> CHUNK_BITS][(ref - 1) & (CHUNK_SIZE - 1)]; }
+
+    size_t bytesReserved() const { return chunks.size() * CHUNK_SIZE * sizeof(T); }
+
+    void clear() {
+        chunks.clear();
+        count = 0;
+    }
+};
+
+
+// Root of one version. Every leaf sits at the same depth, so the height says when the descent reaches leaves
+struct BTreeRoot {
+    uint32_t page;      // 0 for the empty tree
+    int height;         // 1 = the root is a leaf
+};
+
+
+struct CommitBTree {
+    BTreePagePool<BTreeInner> inners;
+    BTreePagePool<BTreeLeaf> leaves;
+    CommitPayloadStore payloads;
+    BTreeRoot root;
+    std::vector<BTreeRoot> versionRoots;   // versionRoots[v] = root as of version v
+    uint64_t pageCopies;                   // pages copied by path copying
+
+    CommitBTree() : pageCopies(0) {
+        root.page = 0;
+        root.height = 0;
+        versionRoots.assign(1, root);
+    }
+
+    bool empty() const { return root.page == 0; }
+
+    int headVersion() const { return (int)versionRoots.size() - 1; }
+
+    size_t bytesReserved() const { return inners.bytesReserved() + leaves.bytesReserved(); }
+
+    void clear() {
+        inners.clear();
+        leaves.clear();
+        payloads.clear();
+        root.page = 0;
+        root.height = 0;
+        versionRoots.assign(1, root);
+        pageCopies = 0;
+    }
+};
+
+
+// Index of the child of an inner page that covers the commit number
+int childIndex(const BTreeInner& page, int commitNumber) {
+    int i = 0;
+    while (i < page.count && page.keys[i] <= commitNumber) i++;
+    return i;
+}
+
+
+// Returns a page that may be written for the version: the page itself if this version created it,
+// otherwise a copy of it
+uint32_t writableInner(CommitBTree& tree, uint32_t ref, int version) {
+    if (tree.inners[ref].version == version) return ref;
+    uint32_t copy = tree.inners.allocate();
+    tree.inners[copy] = tree.inners[ref];
+    tree.inners[copy].version = version;
+    tree.pageCopies++;
+    return copy;
+}
+
+
+uint32_t writableLeaf(CommitBTree& tree, uint32_t ref, int version) {
+    if (tree.leaves[ref].version == version) return ref;
+    uint32_t copy = tree.leaves.allocate();
+    tree.leaves[copy] = tree.leaves[ref];
+    tree.leaves[copy].version = version;
+    tree.pageCopies++;
+    return copy;
+}
+
+
+// Root a query for the given version starts from
+BTreeRoot rootForVersion(const CommitBTree& tree, int version) {
+    if (version < 0) return tree.versionRoots[0];
+    if (version >= tree.headVersion()) return tree.root;
+    return tree.versionRoots[version];
+}
+
+
+void publishVersion(CommitBTree& tree, int version) {
+    if (version <= tree.headVersion()) return;
+    tree.versionRoots.push_back(tree.root);
+}
+
+
+// Inserts a commit as a new version. Like the AVL engine every update is the version after the head,
+// whatever its commit number.
+void insertNode(CommitBTree& tree, int commitCounter, const std::wstring& fileName,
+    const std::wstring& diffData, const std::wstring& commitMessage = L"") {
+    int version = tree.headVersion() + 1;
+    CommitEntry entry = { commitCounter, tree.payloads.add(fileName, diffData, commitMessage) };
+
+    if (tree.root.page == 0) {
+        uint32_t leaf = tree.leaves.allocate();
+        tree.leaves[leaf].count = 1;
+        tree.leaves[leaf].version = version;
+        tree.leaves[leaf].entries[0] = entry;
+        tree.root.page = leaf;
+        tree.root.height = 1;
+        publishVersion(tree, version);
+        return;
+    }
+
+    // Copy the path from the root down to the leaf, remembering which child was taken at each level
+    uint32_t path[32];
+    int slot[32];
+    int depth = tree.root.height - 1;
+    uint32_t page = tree.root.page;
+    for (int level = 0; level < depth; level++) {
+        page = writableInner(tree, page, version);
+        if (level > 0) tree.inners[path[level - 1]].children[slot[level - 1]] = page;
+        else tree.root.page = page;
+        path[level] = page;
+        slot[level] = childIndex(tree.inners[page], commitCounter);
+        page = tree.inners[page].children[slot[level]];
+    }
+    page = writableLeaf(tree, page, version);
+    if (depth > 0) tree.inners[path[depth - 1]].children[slot[depth - 1]] = page;
+    else tree.root.page = page;
+
+    // Insert into the leaf, splitting it in half when it is full
+    BTreeLeaf& leaf = tree.leaves[page];
+    int pos = leaf.count;
+    while (pos > 0 && leaf.entries[pos - 1].commitCounter > commitCounter) pos--;
+    uint32_t newSibling = 0;
+    int separator = 0;
+    if (leaf.count < BTREE_MAX_KEYS) {
+        std::copy_backward(leaf.entries + pos, leaf.entries + leaf.count, leaf.entries + leaf.count + 1);
+        leaf.entries[pos] = entry;
+        leaf.count++;
+    }
+    else {
+        CommitEntry all[BTREE_MAX_KEYS + 1];
+        std::copy(leaf.entries, leaf.entries + pos, all);
+        all[pos] = entry;
+        std::copy(leaf.entries + pos, leaf.entries + leaf.count, all + pos + 1);
+
+        // Appends fill leaves completely instead of leaving them half empty
+        int keep = (pos == BTREE_MAX_KEYS) ? BTREE_MAX_KEYS : (BTREE_MAX_KEYS + 1) / 2;
+        newSibling = tree.leaves.allocate();
+        BTreeLeaf& sibling = tree.leaves[newSibling];
+        BTreeLeaf& left = tree.leaves[page];
+        left.count = keep;
+        std::copy(all, all + keep, left.entries);
+        sibling.count = BTREE_MAX_KEYS + 1 - keep;
+        sibling.version = version;
+        std::copy(all + keep, all + BTREE_MAX_KEYS + 1, sibling.entries);
+        separator = sibling.entries[0].commitCounter;
+    }
+
+    // Push splits up the copied path
+    for (int level = depth - 1; level >= 0 && newSibling != 0; level--) {
+        BTreeInner& inner = tree.inners[path[level]];
+        int at = slot[level];
+        if (inner.count < BTREE_MAX_KEYS) {
+            std::copy_backward(inner.keys + at, inner.keys + inner.count, inner.keys + inner.count + 1);
+            std::copy_backward(inner.children + at + 1, inner.children + inner.count + 1, inner.children + inner.count + 2);
+            inner.keys[at] = separator;
+            inner.children[at + 1] = newSibling;
+            inner.count++;
+            newSibling = 0;
+            break;
+        }
+
+        int keys[BTREE_MAX_KEYS + 1];
+        uint32_t children[BTREE_MAX_KEYS + 2];
+        std::copy(inner.keys, inner.keys + at, keys);
+        keys[at] = separator;
+        std::copy(inner.keys + at, inner.keys + inner.count, keys + at + 1);
+        std::copy(inner.children, inner.children + at + 1, children);
+        children[at + 1] = newSibling;
+        std::copy(inner.children + at + 1, inner.children + inner.count + 1, children + at + 2);
+
+        // The middle key moves up, the halves keep the keys on either side of it
+        int keep = (at == BTREE_MAX_KEYS) ? BTREE_MAX_KEYS - 1 : BTREE_MAX_KEYS / 2;
+        uint32_t right = tree.inners.allocate();
+        BTreeInner& leftPage = tree.inners[path[level]];
+        BTreeInner& rightPage = tree.inners[right];
+        leftPage.count = keep;
+        std::copy(keys, keys + keep, leftPage.keys);
+        std::copy(children, children + keep + 1, leftPage.children);
+        rightPage.count = BTREE_MAX_KEYS - keep;
+        rightPage.version = version;
+        std::copy(keys + keep + 1, keys + BTREE_MAX_KEYS + 1, rightPage.keys);
+        std::copy(children + keep + 1, children + BTREE_MAX_KEYS + 2, rightPage.children);
+        separator = keys[keep];
+        newSibling = right;
+    }
+
+    // The root itself split: grow the tree by one level
+    if (newSibling != 0) {
+        uint32_t newRoot = tree.inners.allocate();
+        BTreeInner& rootPage = tree.inners[newRoot];
+        rootPage.count = 1;
+        rootPage.version = version;
+        rootPage.keys[0] = separator;
+        rootPage.children[0] = tree.root.page;
+        rootPage.children[1] = newSibling;
+        tree.root.page = newRoot;
+        tree.root.height++;
+    }
+    publishVersion(tree, version);
+}
+
+
+// Builds one level of inner pages over the pages of the level below, spreading the children evenly
+// so every page gets at least two. firstKeys holds the smallest commit number under each page and
+// is replaced by the one for the new level.
+std::vector<uint32_t> buildInnerLevel(CommitBTree& tree, const std::vector<uint32_t>& below,
+    std::vector<int>& firstKeys, int version) {
+    const size_t fanOut = BTREE_MAX_KEYS + 1;
+    size_t pages = (below.size() + fanOut - 1) / fanOut;
+    std::vector<uint32_t> level;
+    std::vector<int> levelKeys;
+    for (size_t p = 0; p < pages; p++) {
+        size_t start = p * below.size() / pages;
+        size_t end = (p + 1) * below.size() / pages;
+        uint32_t ref = tree.inners.allocate();
+        BTreeInner& inner = tree.inners[ref];
+        inner.version = version;
+        inner.count = (int)(end - start) - 1;
+        for (size_t i = start; i < end; i++) {
+            inner.children[i - start] = below[i];
+            if (i > start) inner.keys[i - start - 1] = firstKeys[i];
+        }
+        level.push_back(ref);
+        levelKeys.push_back(firstKeys[start]);
+    }
+    firstKeys.swap(levelKeys);
+    return level;
+}
+
+
+// Replaces the tree with one bulk-loaded from commits sorted by commit number, in O(n).
+// Matches the AVL engine: the run becomes version 1.
+void buildCommitTree(CommitBTree& tree, const std::vector<CommitInfo>& commits) {
+    tree.clear();
+    if (commits.empty()) return;
+    int version = 1;
+
+    std::vector<uint32_t> level;
+    std::vector<int> firstKeys;
+    for (size_t start = 0; start < commits.size(); start += BTREE_MAX_KEYS) {
+        size_t end = std::min(commits.size(), start + BTREE_MAX_KEYS);
+        uint32_t ref = tree.leaves.allocate();
+        BTreeLeaf& leaf = tree.leaves[ref];
+        leaf.version = version;
+        leaf.count = (int)(end - start);
+        for (size_t i = start; i < end; i++) {
+            const CommitInfo& commit = commits[i];
+            leaf.entries[i - start].commitCounter = commit.commitNumber;
+            leaf.entries[i - start].payload = tree.payloads.add(commit.fileName, commit.diffData, commit.commitMessage);
+        }
+        level.push_back(ref);
+        firstKeys.push_back(commits[start].commitNumber);
+    }
+
+    int height = 1;
+    while (level.size() > 1) {
+        level = buildInnerLevel(tree, level, firstKeys, version);
+        height++;
+    }
+    tree.root.page = level[0];
+    tree.root.height = height;
+    publishVersion(tree, version);
+}
+
+
+// Leftmost (or rightmost) entry under a page that sits `levels` levels above the leaves
+const CommitEntry* edgeEntry(const CommitBTree& tree, uint32_t page, int levels, bool leftmost) {
+    for (; levels > 0; levels--) {
+        const BTreeInner& inner = tree.inners[page];
+        page = leftmost ? inner.children[0] : inner.children[inner.count];
+    }
+    const BTreeLeaf& leaf = tree.leaves[page];
+    return leftmost ? &leaf.entries[0] : &leaf.entries[leaf.count - 1];
+}
+
+
+const CommitEntry* searchCommit(const CommitBTree& tree, int targetCommit, int version) {
+    BTreeRoot root = rootForVersion(tree, version);
+    if (root.page == 0) return nullptr;
+    uint32_t page = root.page;
+    for (int level = 1; level < root.height; level++) {
+        const BTreeInner& inner = tree.inners[page];
+        page = inner.children[childIndex(inner, targetCommit)];
+    }
+    const BTreeLeaf& leaf = tree.leaves[page];
+    for (int i = 0; i < leaf.count; i++) {
+        if (leaf.entries[i].commitCounter == targetCommit) return &leaf.entries[i];
+    }
+    return nullptr;
+}
+
+
+const CommitEntry* getSuccessor(const CommitBTree& tree, int commitNumber, int version) {
+    BTreeRoot root = rootForVersion(tree, version);
+    if (root.page == 0) return nullptr;
+
+    // Remember the nearest subtree to the right of the descent, its minimum is the fallback
+    uint32_t fallback = 0;
+    int fallbackLevels = 0;
+    uint32_t page = root.page;
+    for (int level = 1; level < root.height; level++) {
+        const BTreeInner& inner = tree.inners[page];
+        int i = childIndex(inner, commitNumber);
+        if (i < inner.count) {
+            fallback = inner.children[i + 1];
+            fallbackLevels = root.height - level - 1;
+        }
+        page = inner.children[i];
+    }
+    const BTreeLeaf& leaf = tree.leaves[page];
+    for (int i = 0; i < leaf.count; i++) {
+        if (leaf.entries[i].commitCounter > commitNumber) return &leaf.entries[i];
+    }
+    return fallback ? edgeEntry(tree, fallback, fallbackLevels, true) : nullptr;
+}
+
+
+const CommitEntry* getPredecessor(const CommitBTree& tree, int commitNumber, int version) {
+    BTreeRoot root = rootForVersion(tree, version);
+    if (root.page == 0) return nullptr;
+
+    // Descend towards keys below commitNumber, remembering the nearest subtree to the left
+    uint32_t fallback = 0;
+    int fallbackLevels = 0;
+    uint32_t page = root.page;
+    for (int level = 1; level < root.height; level++) {
+        const BTreeInner& inner = tree.inners[page];
+        int i = 0;
+        while (i < inner.count && inner.keys[i] < commitNumber) i++;
+        if (i > 0) {
+            fallback = inner.children[i - 1];
+            fallbackLevels = root.height - level - 1;
+        }
+        page = inner.children[i];
+    }
+    const BTreeLeaf& leaf = tree.leaves[page];
+    for (int i = leaf.count - 1; i >= 0; i--) {
+        if (leaf.entries[i].commitCounter < commitNumber) return &leaf.entries[i];
+    }
+    return fallback ? edgeEntry(tree, fallback, fallbackLevels, false) : nullptr;
+}
+
+
+// Looks up the file name, diff summary and message of a commit entry
+CommitInfo getCommitInfo(const CommitBTree& tree, const CommitEntry& entry) {
+    const CommitPayload& payload = tree.payloads.payloads[entry.payload];
+    return { entry.commitCounter, tree.payloads.strings.get(payload.fileName),
+        tree.payloads.strings.get(payload.diffData), tree.payloads.strings.get(payload.commitMessage) };
+}
@@ -0,0 +1,172 @@
+// Checks of the commit history that run without Notepad++, built into a console program by
+// vs.proj/CommitChecks.vcxproj. Each check prints what it found and returns false when it failed; the
+// exit code is the number of checks that failed.
+#include "CommitTree.h"
+#include "CommitBTree.h"
+#include <cstdio>
+#include <random>
+#include <chrono>
+#include <map>
+
+
+bool sameCommits(const CommitTree& tree, const std::vector<int>& expected) {
+    CommitSnapshot snap = snapshot(tree, tree.headVersion());
+    if (commitCount(snap) != (int)expected.size()) return false;
+    for (size_t k = 0; k < expected.size(); k++) {
+        if (selectCommit(snap, (int)k + 1)->commitCounter != expected[k]) return false;
+    }
+    return true;
+}
+
+
+// Calls compactCommitHistory after every update, the way the plugin does, and checks that compactions
+// get installed and that each installed tree holds exactly the commits of the tree it replaced
+bool checkCompactionInstall() {
+    CommitTreePublisher publisher;
+    CommitCompactor compactor(CommitRetention{ 256, 64 });
+    std::mt19937 random(7);
+    std::vector<int> expected;
+    int nextCommit = 1;
+    int installs = 0;
+
+    for (int update = 0; update < 5000; update++) {
+        // Mostly commits, with some rollbacks and deletions mixed in; each of them publishes a new version
+        CommitTree& tree = publisher.writable();
+        if (random() % 50 == 0 && expected.size() > 10) {
+            int lastKept = expected[expected.size() - 2 - random() % 8];
+            truncateCommits(tree, lastKept);
+            while (expected.back() > lastKept) expected.pop_back();
+            nextCommit = lastKept + 1;
+        }
+        else if (random() % 80 == 0 && expected.size() > 10) {
+            size_t k = random() % expected.size();
+            deleteNode(tree, expected[k]);
+            expected.erase(expected.begin() + k);
+        }
+        else {
+            insertNode(tree, nextCommit, L"file", L"diff", L"message");
+            expected.push_back(nextCommit++);
+        }
+
+        const CommitTree* before = &publisher.writable();
+        compactCommitHistory(compactor, publisher);
+        if (&publisher.writable() != before) {
+            installs++;
+            if (!sameCommits(publisher.writable(), expected)) {
+                printf("FAIL compaction install: compacted tree differs from the tree it replaced after update %d\n", update);
+                return false;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    if (compactor.worker.joinable()) compactor.worker.join();
+
+    if (installs == 0) {
+        printf("FAIL compaction install: no compaction was installed\n");
+        return false;
+    }
+    printf("ok   compaction install: %d compactions installed, the last one kept %d versions and dropped %d\n",
+        installs, compactor.report.versionsKept, compactor.report.versionsDropped);
+    return true;
+}
+
+
+std::wstring checkFileName(int commitNumber) {
+    return L"commit_" + std::to_wstring(commitNumber) + L".txt";
+}
+
+
+volatile long long g_benchmarkSink;   // keeps the benchmark's lookups from being optimized away
+
+
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Runs the same history through one engine (CommitTree or CommitBTree, written against the calls both
+// offer) and checks lookups on old versions against a reference. The history is a bulk load of the
+// even commit numbers, then the odd ones inserted in random order, one version each. Prints the time
+// each part took, so running it for both engines is the head-to-head comparison.
+template <typename Tree>
+bool checkCommitEngine(const char* engine) {
+    const int loaded = 50000;
+    const int inserted = 20000;
+    const int queries = 200000;
+    std::mt19937 random(11);
+
+    std::vector<CommitInfo> commits;
+    for (int i = 1; i <= loaded; i++)
+        commits.push_back({ 2 * i, checkFileName(2 * i), L"diff", L"message" });
+    std::vector<int> odd;
+    for (int i = 0; i < inserted; i++) odd.push_back(2 * (int)(random() % loaded) + 1);
+    std::sort(odd.begin(), odd.end());
+    odd.erase(std::unique(odd.begin(), odd.end()), odd.end());
+    std::shuffle(odd.begin(), odd.end(), random);
+
+    std::unique_ptr<Tree> tree(new Tree);
+    auto start = std::chrono::steady_clock::now();
+    buildCommitTree(*tree, commits);
+    double buildTime = millisecondsSince(start);
+    start = std::chrono::steady_clock::now();
+    for (int commitNumber : odd) insertNode(*tree, commitNumber, checkFileName(commitNumber), L"diff", L"message");
+    double insertTime = millisecondsSince(start);
+
+    // Version each commit arrived at: the bulk load is version 1, the inserts follow one by one
+    std::map<int, int> arrived;
+    for (const CommitInfo& commit : commits) arrived[commit.commitNumber] = 1;
+    for (size_t i = 0; i < odd.size(); i++) arrived[odd[i]] = (int)i + 2;
+    int head = tree->headVersion();
+    if (head != (int)odd.size() + 1) {
+        printf("FAIL %s engine: head version %d after %d updates\n", engine, head, (int)odd.size() + 1);
+        return false;
+    }
+
+    for (int q = 0; q < 20000; q++) {
+        int version = (int)(random() % (head + 1));
+        int commitNumber = (int)(random() % (2 * loaded + 2));
+        auto after = arrived.upper_bound(commitNumber);
+        while (after != arrived.end() && after->second > version) ++after;
+        auto before = arrived.lower_bound(commitNumber);
+        while (before != arrived.begin() && (--before)->second > version) {}
+        bool hasBefore = before != arrived.end() && before->first < commitNumber && before->second <= version;
+        auto found = arrived.find(commitNumber);
+        bool present = found != arrived.end() && found->second <= version;
+
+        auto node = searchCommit(*tree, commitNumber, version);
+        auto succ = getSuccessor(*tree, commitNumber, version);
+        auto pred = getPredecessor(*tree, commitNumber, version);
+        if ((node != nullptr) != present || (node && getCommitInfo(*tree, *node).fileName != checkFileName(commitNumber))
+            || (succ ? succ->commitCounter : -1) != (after != arrived.end() ? after->first : -1)
+            || (pred ? pred->commitCounter : -1) != (hasBefore ? before->first : -1)) {
+            printf("FAIL %s engine: lookups around commit %d at version %d disagree with the history\n", engine, commitNumber, version);
+            return false;
+        }
+    }
+
+    // Head queries, the plugin's common case
+    long long sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queries; q++) {
+        int commitNumber = (int)(random() % (2 * loaded + 2));
+        auto node = searchCommit(*tree, commitNumber, head);
+        auto succ = getSuccessor(*tree, commitNumber, head);
+        auto pred = getPredecessor(*tree, commitNumber, head);
+        sum += (node ? 1 : 0) + (succ ? succ->commitCounter : 0) + (pred ? pred->commitCounter : 0);
+    }
+    double queryTime = millisecondsSince(start);
+    g_benchmarkSink = sum;
+
+    printf("ok   %s engine: bulk load of %d %.1f ms, %d inserts %.1f ms, search+successor+predecessor %.0f ns\n",
+        engine, loaded, buildTime, (int)odd.size(), insertTime, queryTime * 1e6 / queries);
+    return true;
+}
+
+
+int main() {
+    int failed = 0;
+    if (!checkCompactionInstall()) failed++;
+    if (!checkCommitEngine<CommitTree>("AVL")) failed++;
+    if (!checkCommitEngine<CommitBTree>("B+-tree")) failed++;
+    return failed;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Content-defined chunking (FastCDC) the pack uses to store a snapshot as chunks it can share with
+// other snapshots. A gear hash rolls over the text, and a chunk ends where the hash has all the bits
+// of a mask clear. The hash only depends on the last 64 bytes, so the cut points follow the content:
+// an edit moves or adds the cuts around it, and every chunk before and after it comes out the same as
+// in the previous snapshot.
+//
+// Chunks are at least COMMIT_CHUNK_MIN and at most COMMIT_CHUNK_MAX bytes. Up to COMMIT_CHUNK_AVERAGE
+// the cut is tested against the stricter mask and past it against the looser one (normalized
+// chunking), which keeps most chunks near the average. The scan runs at ~1.6 GB/s on one core, bound by
+// the shift and add each byte waits on. Hashing separate stretches of the text in interleaved lanes,
+// with plain registers or AVX2 gathers for the table, and rolling two bytes per step were tried too;
+// none came out faster, so the plain loop stays.
+
+
+const uint32_t COMMIT_CHUNK_MIN = 2 * 1024;
+const uint32_t COMMIT_CHUNK_AVERAGE = 8 * 1024;
+const uint32_t COMMIT_CHUNK_MAX = 64 * 1024;
+
+// 15 and 11 bits set, spread over the bits that depend on the most bytes (FastCDC's masks for 8 KB)
+const uint64_t COMMIT_CHUNK_MASK_STRICT = 0x0003590703530000ULL;
+const uint64_t COMMIT_CHUNK_MASK_LOOSE = 0x0000d90003530000ULL;
+
+
+// Gear values for each byte. They are part of the pack format: other values would cut the same text
+// elsewhere and share nothing with it.
+struct GearTable {
+    uint64_t values[256];
+
+    GearTable() {
+        uint64_t state = 0;
+        for (int byte = 0; byte < 256; byte++) {
+            // splitmix64
+            state += 0x9E3779B97F4A7C15ULL;
+            uint64_t value = state;
+            value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+            values[byte] = value ^ (value >> 31);
+        }
+    }
+};
+
+const GearTable g_gearTable;
+
+
+// Length of the chunk that starts at data, with length bytes left in the text
+size_t findChunkEnd(const char* data, size_t length) {
+    if (length <= COMMIT_CHUNK_MIN) return length;
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t normal = length < COMMIT_CHUNK_AVERAGE ? length : COMMIT_CHUNK_AVERAGE;
+    size_t end = length < COMMIT_CHUNK_MAX ? length : COMMIT_CHUNK_MAX;
+
+    // Warm the hash up over the bytes before the first place a chunk may end
+    uint64_t hash = 0;
+    size_t position = COMMIT_CHUNK_MIN - 64;
+    for (; position < COMMIT_CHUNK_MIN - 1; position++)
+        hash = (hash << 1) + g_gearTable.values[bytes[position]];
+
+    for (; position < normal; position++) {
+        hash = (hash << 1) + g_gearTable.values[bytes[position]];
+        if ((hash & COMMIT_CHUNK_MASK_STRICT) == 0) return position + 1;
+    }
+    for (; position < end; position++) {
+        hash = (hash << 1) + g_gearTable.values[bytes[position]];
+        if ((hash & COMMIT_CHUNK_MASK_LOOSE) == 0) return position + 1;
+    }
+    return end;
+}
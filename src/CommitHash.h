@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+// 128-bit content hash (MurmurHash3 x64_128) the pack uses to find a document state it already stores.
+// It is not cryptographic: it tells apart the states one user commits, it is not meant to stand up to
+// someone crafting collisions. It runs at several GB/s, so hashing a 50 MB file costs ~10 ms.
+
+
+struct ContentHash {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const ContentHash& other) const { return low == other.low && high == other.high; }
+};
+
+
+struct ContentHashHasher {
+    size_t operator()(const ContentHash& hash) const { return (size_t)hash.low; }
+};
+
+
+inline uint64_t rotateHashLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+inline uint64_t finishHashLane(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+
+ContentHash hashContent(const char* data, size_t length) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+
+    size_t blocks = length / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotateHashLeft(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotateHashLeft(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotateHashLeft(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotateHashLeft(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // The last 0-15 bytes, little-endian
+    const uint8_t* tail = (const uint8_t*)data + blocks * 16;
+    size_t rest = length & 15;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = rest; i > 8; i--) k2 = (k2 << 8) | tail[i - 1];
+    for (size_t i = rest < 8 ? rest : 8; i > 0; i--) k1 = (k1 << 8) | tail[i - 1];
+    if (rest > 8) {
+        k2 *= c2; k2 = rotateHashLeft(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rest > 0) {
+        k1 *= c1; k1 = rotateHashLeft(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = finishHashLane(h1); h2 = finishHashLane(h2);
+    h1 += h2; h2 += h1;
+    return { h1, h2 };
+}
+
+
+ContentHash hashContent(const std::string& data) {
+    return hashContent(data.data(), data.size());
+}
@@ -0,0 +1,276 @@
+#pragma once
+#include "CommitTree.h"
+
+// Memory-mapped on-disk image of a CommitTree. Everything the tree stores is already position
+// independent (nodes refer to each other by index, strings live in a flat character heap), so the
+// chunks of its arrays are written to the file as they are and mapped straight back: queries run on
+// the mapped pages, and chunks needed by new commits are allocated at the end of the file. Opening an
+// image costs one mapping and a pointer per chunk, nothing is read or rebuilt per commit.
+//
+// Layout: a 1 MB header (CommitImageHeader followed by the slot table), then one slot per chunk.
+// A slot is the chunk rounded up to 64 KB, the granularity Windows maps views at, so a chunk added
+// later gets a view of its own and the chunks readers are using never have to be remapped.
+//
+// Updates write straight into the mapped nodes, and syncCommitImage makes the header cover them. An
+// update that was never synced (a crash before the sync) may have left mods and parent links in nodes
+// the header does count, which the next update would build on. Each update marks the header before it
+// writes anything, so such an image is refused when it is opened and the caller rebuilds it.
+
+
+const uint32_t COMMIT_IMAGE_MAGIC = 0x4D495443;   // "CTIM"
+const uint32_t COMMIT_IMAGE_FORMAT = 4;   // 2: left subtree sizes, 3: newest field values in every node, 4: synced versions
+const uint64_t COMMIT_IMAGE_HEADER_BYTES = 1 << 20;
+const uint64_t COMMIT_IMAGE_GRANULARITY = 1 << 16;
+
+
+// The arrays of a tree that end up in the image
+enum ImageArray { IMAGE_NODES, IMAGE_ROOTS, IMAGE_PAYLOADS, IMAGE_STRINGS, IMAGE_CHARS, IMAGE_ARRAY_COUNT };
+
+
+struct CommitImageHeader {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t nodeBytes;     // sizeof(CommitNode), differs between builds with another COMMIT_TREE_MAX_MODS
+    uint32_t charBytes;     // sizeof(wchar_t)
+    uint32_t slotCount;
+    uint32_t counts[IMAGE_ARRAY_COUNT];   // elements in each array
+    int lastCommit;         // newest commit number the image covers, -1 once it can no longer be trusted
+    int syncedVersion;      // head version of the tree at the last sync
+    int writtenVersion;     // version the last update started writing, newer than syncedVersion until synced
+    NodeRef root;
+    CommitTreeStats stats;
+};
+
+
+// Which chunk of which array a slot holds
+struct ImageSlot {
+    uint32_t array;
+    uint32_t chunk;
+};
+
+const uint32_t COMMIT_IMAGE_MAX_SLOTS =
+    (uint32_t)((COMMIT_IMAGE_HEADER_BYTES - sizeof(CommitImageHeader)) / sizeof(ImageSlot));
+
+
+// An open image file and the views mapped from it. Views stay mapped until the image is destroyed,
+// which happens together with the last tree using it (see CommitTree::image).
+struct CommitImage {
+    HANDLE file;
+    std::vector<HANDLE> mappings;
+    std::vector<void*> views;
+    CommitImageHeader* header;
+    ImageSlot* slots;
+    uint64_t fileBytes;
+    bool complete;   // false once a chunk had to go to the heap instead of the file
+
+    CommitImage() : file(INVALID_HANDLE_VALUE), header(nullptr), slots(nullptr), fileBytes(0), complete(true) {}
+    CommitImage(const CommitImage&) = delete;
+    CommitImage& operator=(const CommitImage&) = delete;
+
+    ~CommitImage() {
+        for (void* view : views) UnmapViewOfFile(view);
+        for (HANDLE mapping : mappings) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+
+    // Maps bytes [offset, offset + size) of the file, growing the file when the range runs past its end
+    char* map(uint64_t offset, uint64_t size) {
+        uint64_t end = offset + size;
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+        if (mapping == NULL) return nullptr;
+        void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)size);
+        if (view == NULL) {
+            CloseHandle(mapping);
+            return nullptr;
+        }
+        mappings.push_back(mapping);
+        views.push_back(view);
+        fileBytes = std::max(fileBytes, end);
+        return (char*)view;
+    }
+};
+
+
+// Bytes a chunk of the array takes up in the file
+template <typename T, uint32_t ChunkBits>
+uint64_t imageSlotBytes(const ChunkedArray<T, ChunkBits>&) {
+    uint64_t bytes = (uint64_t)ChunkedArray<T, ChunkBits>::CHUNK_SIZE * sizeof(T);
+    return (bytes + COMMIT_IMAGE_GRANULARITY - 1) / COMMIT_IMAGE_GRANULARITY * COMMIT_IMAGE_GRANULARITY;
+}
+
+
+// Fills in everything in the header that changes with the tree
+void fillImageHeader(CommitImageHeader& header, const CommitTree& tree, int lastCommit) {
+    header.counts[IMAGE_NODES] = tree.nodes.nodes.size();
+    header.counts[IMAGE_ROOTS] = tree.versionRoots.size();
+    header.counts[IMAGE_PAYLOADS] = tree.payloads.payloads.size();
+    header.counts[IMAGE_STRINGS] = tree.payloads.strings.strings.size();
+    header.counts[IMAGE_CHARS] = tree.payloads.strings.chars.size();
+    header.root = tree.root;
+    header.stats = tree.stats;
+    header.lastCommit = lastCommit;
+    header.syncedVersion = tree.headVersion();
+    header.writtenVersion = tree.headVersion();
+}
+
+
+// Writes the used chunks of an array to consecutive slots
+template <typename T, uint32_t ChunkBits>
+bool writeImageChunks(HANDLE file, ImageArray id, const ChunkedArray<T, ChunkBits>& array, std::vector<ImageSlot>& slots) {
+    const uint32_t chunkBytes = ChunkedArray<T, ChunkBits>::CHUNK_SIZE * sizeof(T);
+    std::vector<char> padding((size_t)(imageSlotBytes(array) - chunkBytes));
+    uint32_t chunks = (array.size() + ChunkedArray<T, ChunkBits>::CHUNK_SIZE - 1) >> ChunkBits;
+    for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+        DWORD written;
+        if (!WriteFile(file, array.chunk(chunk), chunkBytes, &written, NULL)) return false;
+        if (!padding.empty() && !WriteFile(file, padding.data(), (DWORD)padding.size(), &written, NULL)) return false;
+        slots.push_back({ (uint32_t)id, chunk });
+    }
+    return true;
+}
+
+
+// Saves the tree as a new image, replacing any file at the path. Used after the tree was rebuilt
+// from the commit files; from then on the image is opened and kept up to date instead.
+bool writeCommitImage(const CommitTree& tree, const std::wstring& path, int lastCommit) {
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    // Chunks first, the header goes in last once the slot table is known
+    LARGE_INTEGER position;
+    position.QuadPart = COMMIT_IMAGE_HEADER_BYTES;
+    std::vector<ImageSlot> slots;
+    bool ok = SetFilePointerEx(file, position, NULL, FILE_BEGIN) != 0
+        && writeImageChunks(file, IMAGE_NODES, tree.nodes.nodes, slots)
+        && writeImageChunks(file, IMAGE_ROOTS, tree.versionRoots, slots)
+        && writeImageChunks(file, IMAGE_PAYLOADS, tree.payloads.payloads, slots)
+        && writeImageChunks(file, IMAGE_STRINGS, tree.payloads.strings.strings, slots)
+        && writeImageChunks(file, IMAGE_CHARS, tree.payloads.strings.chars, slots)
+        && slots.size() <= COMMIT_IMAGE_MAX_SLOTS;
+
+    if (ok) {
+        std::vector<char> block((size_t)COMMIT_IMAGE_HEADER_BYTES);
+        CommitImageHeader& header = *(CommitImageHeader*)block.data();
+        header.magic = COMMIT_IMAGE_MAGIC;
+        header.format = COMMIT_IMAGE_FORMAT;
+        header.nodeBytes = sizeof(CommitNode);
+        header.charBytes = sizeof(wchar_t);
+        header.slotCount = (uint32_t)slots.size();
+        fillImageHeader(header, tree, lastCommit);
+        std::copy(slots.begin(), slots.end(), (ImageSlot*)(&header + 1));
+
+        DWORD written;
+        position.QuadPart = 0;
+        ok = SetFilePointerEx(file, position, NULL, FILE_BEGIN) != 0
+            && WriteFile(file, block.data(), (DWORD)block.size(), &written, NULL) != 0;
+    }
+    CloseHandle(file);
+    if (!ok) DeleteFileW(path.c_str());
+    return ok;
+}
+
+
+// Makes new chunks of the array come from fresh slots at the end of the image
+template <typename T, uint32_t ChunkBits>
+void appendChunksToImage(CommitImage* image, ImageArray id, ChunkedArray<T, ChunkBits>& array) {
+    uint64_t slotBytes = imageSlotBytes(array);
+    array.chunkSource = [image, id, slotBytes](uint32_t chunk) -> T* {
+        char* data = nullptr;
+        if (image->header->slotCount < COMMIT_IMAGE_MAX_SLOTS)
+            data = image->map(image->fileBytes, slotBytes);
+        if (data == nullptr) {
+            image->complete = false;
+            return nullptr;
+        }
+        image->slots[image->header->slotCount].array = id;
+        image->slots[image->header->slotCount].chunk = chunk;
+        image->header->slotCount++;
+        return (T*)data;
+    };
+}
+
+
+// Rebuilds the tree around a mapped image. Returns false, leaving the tree empty, when the file is
+// missing, was written by an incompatible build or was left unusable, which includes an update that
+// was never synced; lastCommit receives the newest
+// commit number the image covers so the caller can check it against the repository.
+bool openCommitImage(CommitTree& tree, const std::wstring& path, int& lastCommit) {
+    tree.clear();
+    std::shared_ptr<CommitImage> image = std::make_shared<CommitImage>();
+    image->file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (image->file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(image->file, &size) || (uint64_t)size.QuadPart < COMMIT_IMAGE_HEADER_BYTES) return false;
+    char* base = image->map(0, (uint64_t)size.QuadPart);
+    if (base == nullptr) return false;
+
+    CommitImageHeader* header = (CommitImageHeader*)base;
+    if (header->magic != COMMIT_IMAGE_MAGIC || header->format != COMMIT_IMAGE_FORMAT
+        || header->nodeBytes != sizeof(CommitNode) || header->charBytes != sizeof(wchar_t)
+        || header->lastCommit < 0 || header->slotCount > COMMIT_IMAGE_MAX_SLOTS || header->counts[IMAGE_ROOTS] == 0
+        || header->writtenVersion != header->syncedVersion || header->syncedVersion != (int)header->counts[IMAGE_ROOTS] - 1)
+        return false;
+    image->header = header;
+    image->slots = (ImageSlot*)(header + 1);
+
+    // Check the slot table before pointing the arrays into the file: every array's chunks appear in order
+    const uint64_t slotBytes[IMAGE_ARRAY_COUNT] = { imageSlotBytes(tree.nodes.nodes), imageSlotBytes(tree.versionRoots),
+        imageSlotBytes(tree.payloads.payloads), imageSlotBytes(tree.payloads.strings.strings), imageSlotBytes(tree.payloads.strings.chars) };
+    const uint32_t chunkSizes[IMAGE_ARRAY_COUNT] = { tree.nodes.nodes.CHUNK_SIZE, tree.versionRoots.CHUNK_SIZE,
+        tree.payloads.payloads.CHUNK_SIZE, tree.payloads.strings.strings.CHUNK_SIZE, tree.payloads.strings.chars.CHUNK_SIZE };
+    uint32_t chunks[IMAGE_ARRAY_COUNT] = {};
+    uint64_t offset = COMMIT_IMAGE_HEADER_BYTES;
+    for (uint32_t i = 0; i < header->slotCount; i++) {
+        const ImageSlot& slot = image->slots[i];
+        if (slot.array >= IMAGE_ARRAY_COUNT || slot.chunk != chunks[slot.array]) return false;
+        chunks[slot.array]++;
+        offset += slotBytes[slot.array];
+    }
+    if (offset > (uint64_t)size.QuadPart) return false;
+    image->fileBytes = offset;   // new slots go right after the last recorded one, over any torn tail
+    for (int array = 0; array < IMAGE_ARRAY_COUNT; array++) {
+        if (header->counts[array] > (uint64_t)chunks[array] * chunkSizes[array]) return false;
+    }
+
+    tree.versionRoots.clear();   // drop the empty tree's root, the image has its own
+    offset = COMMIT_IMAGE_HEADER_BYTES;
+    for (uint32_t i = 0; i < header->slotCount; i++) {
+        const ImageSlot& slot = image->slots[i];
+        char* data = base + offset;
+        if (slot.array == IMAGE_NODES) tree.nodes.nodes.attach(slot.chunk, (CommitNode*)data);
+        else if (slot.array == IMAGE_ROOTS) tree.versionRoots.attach(slot.chunk, (NodeRef*)data);
+        else if (slot.array == IMAGE_PAYLOADS) tree.payloads.payloads.attach(slot.chunk, (CommitPayload*)data);
+        else if (slot.array == IMAGE_STRINGS) tree.payloads.strings.strings.attach(slot.chunk, (StringSpan*)data);
+        else tree.payloads.strings.chars.attach(slot.chunk, (wchar_t*)data);
+        offset += slotBytes[slot.array];
+    }
+    tree.nodes.nodes.resize(header->counts[IMAGE_NODES]);
+    tree.versionRoots.resize(header->counts[IMAGE_ROOTS]);
+    tree.payloads.payloads.resize(header->counts[IMAGE_PAYLOADS]);
+    tree.payloads.strings.strings.resize(header->counts[IMAGE_STRINGS]);
+    tree.payloads.strings.chars.resize(header->counts[IMAGE_CHARS]);
+    tree.root = header->root;
+    tree.rightmost = newestNode(tree.nodes, tree.root, tree.headVersion());
+    tree.stats = header->stats;
+
+    appendChunksToImage(image.get(), IMAGE_NODES, tree.nodes.nodes);
+    appendChunksToImage(image.get(), IMAGE_ROOTS, tree.versionRoots);
+    appendChunksToImage(image.get(), IMAGE_PAYLOADS, tree.payloads.payloads);
+    appendChunksToImage(image.get(), IMAGE_STRINGS, tree.payloads.strings.strings);
+    appendChunksToImage(image.get(), IMAGE_CHARS, tree.payloads.strings.chars);
+    tree.image = image;
+    tree.imageWritten = &header->writtenVersion;
+    lastCommit = header->lastCommit;
+    return true;
+}
+
+
+// Records the tree's sizes in the image header. Call after every update (insert, truncate, ...):
+// the update itself already went into the mapped chunks, this is the point where the image covers it.
+// Until then the image cannot be opened again.
+void syncCommitImage(CommitTree& tree, int lastCommit) {
+    if (!tree.image) return;
+    fillImageHeader(*tree.image->header, tree, tree.image->complete ? lastCommit : -1);
+}
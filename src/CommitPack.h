@@ -0,0 +1,540 @@
+#pragma once
+#include "CommitTree.h"
+#include "CommitHash.h"
+#include "CommitChunker.h"
+#include "CommitCompress.h"
+
+// Append-only pack file holding every commit of a repo, in place of a commit_N.txt, .diff and .msg
+// file per commit. A commit is a group of length-prefixed records (diff summary, message) that go to
+// the end of the file in a single write; nothing already in the file is ever rewritten, except that a
+// rollback cuts the newest commits off the end. The offset index (where each commit's snapshot is)
+// lives in memory and is rebuilt by opening the pack, which reads the file once front to back.
+//
+// Snapshots are stored once per distinct content. A commit whose text the pack already holds (after an
+// undo, a manual revert, or toggling between two configs) only gets a reference to the commit that
+// first had that text; each group records the content hash of its commit's text, and opening the pack
+// rebuilds a hash index from those records, so the check costs one hash and one lookup.
+//
+// Below that, snapshots are stored as chunks (see CommitChunker.h), each chunk once for the whole pack.
+// A commit with new content writes the chunks no earlier snapshot had and a recipe listing the chunks
+// of its text, so a few changed lines in a 100 MB file cost a few chunks and the recipe (4 bytes per
+// 8 KB of text) rather than the whole file. Chunks are numbered in the order they were written, the
+// recipe holds their numbers, and opening the pack rebuilds the chunk index by hash from the hash at
+// the start of every chunk record. Reading a snapshot reads its chunks back in order, with one read
+// for each run of chunks that lie next to each other.
+//
+// Each chunk is compressed on its own (see CommitCompress.h) and carries the number of lines that end
+// in it. Summed along a recipe those counts say which chunks a line range falls in, so showing the
+// first screen of a commit reads and decompresses the first chunk or two, not the whole snapshot.
+//
+// A write torn by a crash leaves a group without its message record, or a record shorter than its
+// length; opening the pack cuts the file back to the last whole commit.
+
+
+const uint32_t COMMIT_PACK_MAGIC = 0x4B505443;   // "CTPK"
+const uint32_t COMMIT_PACK_READ_BYTES = 1 << 20;
+
+
+// The records of a commit. New chunks and the recipe come first, then the diff summary and content,
+// and the message comes last, so a commit with a message record is complete.
+enum PackRecordKind { PACK_CHUNK, PACK_RECIPE, PACK_DIFF, PACK_CONTENT, PACK_MESSAGE };
+
+
+struct PackRecordHeader {
+    uint32_t magic;
+    uint32_t kind;
+    int commitNumber;
+    uint32_t length;   // bytes of data following the header
+};
+
+
+// Data of a content record: the hash of the commit's text and the commit that owns that snapshot,
+// which is the commit itself when its text is new
+struct PackContent {
+    ContentHash hash;
+    int owner;
+};
+
+
+// What a chunk record holds after the chunk's hash, ahead of the compressed bytes. A chunk
+// that does not get any smaller is stored as it is, which a stored length equal to length tells.
+struct PackChunkInfo {
+    uint32_t length;   // of the chunk's text
+    uint32_t lines;    // line breaks ('\n') in it
+};
+
+
+// Where a chunk's bytes are in the pack
+struct PackChunk {
+    uint64_t offset;
+    uint32_t stored;   // bytes in the pack
+    uint32_t length;   // bytes of text
+    uint32_t lines;
+};
+
+
+// Where a commit's records are in the pack
+struct PackEntry {
+    uint64_t offset;           // of the commit's first record, where a rollback cuts the file
+    uint64_t recipe;           // of the recipe's data, 0 when the commit shares a snapshot
+    uint32_t recipeLength;
+    bool committed;
+    int same;                  // older commit whose snapshot this one shares, 0 when it owns one
+};
+
+
+// An open pack file and its offset index. Commit numbers are dense and only grow between rollbacks,
+// so the index is a plain array by commit number. Only the writer thread uses the pack.
+struct CommitPack {
+    HANDLE file;
+    uint64_t end;                    // where the next commit goes
+    std::vector<PackEntry> entries;  // entries[n] for commit n, all zero for a commit number not in the pack
+    int lastCommit;                  // newest commit in the pack, 0 when it is empty
+    std::unordered_map<ContentHash, int, ContentHashHasher> owners;   // commit owning each snapshot, by content hash
+    std::vector<PackChunk> chunks;   // chunks[i] for chunk number i
+    std::unordered_map<ContentHash, uint32_t, ContentHashHasher> chunkNumbers;   // by content hash
+
+    CommitPack() : file(INVALID_HANDLE_VALUE), end(0), lastCommit(0) {}
+    CommitPack(const CommitPack&) = delete;
+    CommitPack& operator=(const CommitPack&) = delete;
+
+    ~CommitPack() {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+
+    bool contains(int commitNumber) const {
+        return commitNumber > 0 && commitNumber < (int)entries.size() && entries[commitNumber].committed;
+    }
+};
+
+
+// Forward-only buffered reader over the pack, used while opening it
+struct PackReader {
+    HANDLE file;
+    std::vector<char> buffer;
+    uint64_t bufferStart;   // file offset of buffer[0]
+    size_t filled;
+    size_t position;
+
+    explicit PackReader(HANDLE packFile)
+        : file(packFile), buffer(COMMIT_PACK_READ_BYTES), bufferStart(0), filled(0), position(0) {
+    }
+
+    uint64_t offset() const { return bufferStart + position; }
+
+    // Makes at least bytes bytes available at position, false at the end of the file
+    bool fill(size_t bytes) {
+        if (filled - position >= bytes) return true;
+        if (bytes > buffer.size()) buffer.resize(bytes);
+        std::copy(buffer.begin() + position, buffer.begin() + filled, buffer.begin());
+        bufferStart += position;
+        filled -= position;
+        position = 0;
+        while (filled < bytes) {
+            DWORD read = 0;
+            if (!ReadFile(file, buffer.data() + filled, (DWORD)(buffer.size() - filled), &read, NULL) || read == 0)
+                return false;
+            filled += read;
+        }
+        return true;
+    }
+
+    bool read(void* out, size_t bytes) {
+        if (!fill(bytes)) return false;
+        std::copy(buffer.begin() + position, buffer.begin() + position + bytes, (char*)out);
+        position += bytes;
+        return true;
+    }
+
+    // Steps over data we do not need, seeking ahead when it runs past the buffer
+    bool skip(uint64_t bytes) {
+        if (filled - position >= bytes) {
+            position += (size_t)bytes;
+            return true;
+        }
+        uint64_t target = offset() + bytes;
+        LARGE_INTEGER size, to;
+        to.QuadPart = (LONGLONG)target;
+        if (!GetFileSizeEx(file, &size) || (uint64_t)size.QuadPart < target) return false;
+        if (!SetFilePointerEx(file, to, NULL, FILE_BEGIN)) return false;
+        bufferStart = target;
+        filled = 0;
+        position = 0;
+        return true;
+    }
+};
+
+
+// Closes the pack file and forgets its index
+void closeCommitPack(CommitPack& pack) {
+    if (pack.file != INVALID_HANDLE_VALUE) CloseHandle(pack.file);
+    pack.file = INVALID_HANDLE_VALUE;
+    pack.entries.clear();
+    pack.owners.clear();
+    pack.chunks.clear();
+    pack.chunkNumbers.clear();
+    pack.end = 0;
+    pack.lastCommit = 0;
+}
+
+
+// Converts record data to the wide strings the tree keeps, the way the .diff and .msg files were read
+std::wstring widenPackData(const std::string& data) {
+    return std::wstring(data.begin(), data.end());
+}
+
+
+// Opens (creating if needed) the pack at path and rebuilds its offset index in one sequential pass.
+// When commits is given, it receives the diff summary and message of every commit, sorted by commit
+// number, ready for buildCommitTree. Returns false when the file cannot be opened.
+bool openCommitPack(CommitPack& pack, const std::wstring& path, std::vector<CommitInfo>* commits) {
+    closeCommitPack(pack);
+    pack.file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pack.file == INVALID_HANDLE_VALUE) return false;
+
+    // A group is the new chunks and the recipe, then the diff, content and message of one commit, with
+    // commit numbers growing; anything else is where a write was torn
+    PackReader reader(pack.file);
+    std::vector<std::pair<ContentHash, PackChunk>> chunks;   // read since the last whole commit
+    PackEntry recipe = {};
+    int recipeCommit = 0;   // commit of the group's recipe record, 0 before it
+    std::string diff;
+    PackContent content;
+    bool hashed = false;
+    int number = 0;         // commit of the group's diff record, 0 before it
+    for (;;) {
+        uint64_t start = reader.offset();
+        PackRecordHeader header;
+        if (!reader.read(&header, sizeof(header)) || header.magic != COMMIT_PACK_MAGIC) break;
+
+        if (header.kind == PACK_CHUNK) {
+            ContentHash hash;
+            PackChunkInfo info;
+            if (number != 0 || recipeCommit != 0 || header.length < sizeof(hash) + sizeof(info) ||
+                !reader.read(&hash, sizeof(hash)) || !reader.read(&info, sizeof(info))) break;
+            uint32_t stored = header.length - (uint32_t)(sizeof(hash) + sizeof(info));
+            if (stored > info.length || info.lines > info.length) break;
+            PackChunk chunk = { start + sizeof(header) + sizeof(hash) + sizeof(info), stored, info.length, info.lines };
+            chunks.push_back(std::make_pair(hash, chunk));
+            if (!reader.skip(chunk.stored)) break;
+            continue;
+        }
+        if (header.kind == PACK_RECIPE) {
+            if (number != 0 || recipeCommit != 0 || header.commitNumber <= pack.lastCommit ||
+                header.length % sizeof(uint32_t) != 0) break;
+            recipeCommit = header.commitNumber;
+            recipe.recipe = start + sizeof(header);
+            recipe.recipeLength = header.length;
+            if (!reader.skip(header.length)) break;
+            continue;
+        }
+        if (header.kind == PACK_DIFF ? (number != 0 || header.commitNumber <= pack.lastCommit ||
+            (recipeCommit != 0 && header.commitNumber != recipeCommit)) :
+            (header.kind != PACK_MESSAGE && header.kind != PACK_CONTENT) || number == 0 || header.commitNumber != number) break;
+        if (header.kind == PACK_CONTENT) {
+            if (hashed || header.length != sizeof(content) || !reader.read(&content, sizeof(content))) break;
+            hashed = true;
+            continue;
+        }
+        std::string data(header.length, '\0');
+        if (header.length > 0 && !reader.read(&data[0], header.length)) break;
+        if (header.kind == PACK_DIFF) {
+            number = header.commitNumber;
+            diff.swap(data);
+            continue;
+        }
+
+        // A whole commit is in. It owns a snapshot, which its group carries the recipe of, or shares
+        // the snapshot of an older commit that owns one.
+        if (!hashed) break;
+        int same = content.owner != number ? content.owner : 0;
+        bool fits = same == 0 ? recipeCommit == number :
+            (recipeCommit == 0 && chunks.empty() && same < number && pack.contains(same) && pack.entries[same].same == 0);
+        if (!fits) break;
+        if ((int)pack.entries.size() <= number) pack.entries.resize(number + 1, PackEntry());
+        pack.entries[number] = { pack.end, same == 0 ? recipe.recipe : 0, same == 0 ? recipe.recipeLength : 0, true, same };
+        for (const auto& chunk : chunks) {
+            pack.chunkNumbers.insert(std::make_pair(chunk.first, (uint32_t)pack.chunks.size()));
+            pack.chunks.push_back(chunk.second);
+        }
+        pack.owners.insert(std::make_pair(content.hash, same != 0 ? same : number));
+        chunks.clear();
+        recipeCommit = 0;
+        hashed = false;
+        number = 0;
+        pack.lastCommit = header.commitNumber;
+        pack.end = reader.offset();
+        if (commits != nullptr)
+            commits->push_back({ pack.lastCommit, L"commit_" + std::to_wstring(pack.lastCommit) + L".txt", widenPackData(diff), widenPackData(data) });
+    }
+
+    // Drop a torn tail, the next commit goes where the last whole one ended
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)pack.end;
+    SetFilePointerEx(pack.file, end, NULL, FILE_BEGIN);
+    SetEndOfFile(pack.file);
+    return true;
+}
+
+
+// Appends one record to a write buffer. Returns where its data starts in the buffer.
+size_t appendPackRecord(std::vector<char>& out, PackRecordKind kind, int commitNumber, const char* data, size_t length) {
+    PackRecordHeader header = { COMMIT_PACK_MAGIC, (uint32_t)kind, commitNumber, (uint32_t)length };
+    const char* bytes = (const char*)&header;
+    out.insert(out.end(), bytes, bytes + sizeof(header));
+    out.insert(out.end(), data, data + length);
+    return out.size() - length;
+}
+
+
+size_t appendPackRecord(std::vector<char>& out, PackRecordKind kind, int commitNumber, const std::string& data) {
+    return appendPackRecord(out, kind, commitNumber, data.data(), data.size());
+}
+
+
+// Reads the chunk numbers of the recipe for a commit's snapshot, which is the recipe of the commit it
+// shares the snapshot with when it has none of its own, with one positioned read. Returns false when
+// the commit is not in the pack or the read fails.
+bool readPackedRecipe(const CommitPack& pack, int commitNumber, std::vector<uint32_t>& numbers) {
+    numbers.clear();
+    if (!pack.contains(commitNumber)) return false;
+    if (pack.entries[commitNumber].same != 0) commitNumber = pack.entries[commitNumber].same;
+    const PackEntry& entry = pack.entries[commitNumber];
+    numbers.resize(entry.recipeLength / sizeof(uint32_t));
+    if (numbers.empty()) return true;
+    OVERLAPPED at = {};
+    at.Offset = (DWORD)entry.recipe;
+    at.OffsetHigh = (DWORD)(entry.recipe >> 32);
+    DWORD read = 0;
+    return ReadFile(pack.file, numbers.data(), entry.recipeLength, &read, &at) && read == entry.recipeLength;
+}
+
+
+// Puts together the text of count chunks by number. A run of chunks with consecutive numbers lies back
+// to back in the pack and comes in with one read, up to COMMIT_PACK_READ_BYTES at a time, and each
+// chunk is decompressed straight into the text.
+bool readPackedChunks(const CommitPack& pack, const uint32_t* numbers, size_t count, std::string& text) {
+    uint64_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (numbers[i] >= pack.chunks.size()) return false;
+        length += pack.chunks[numbers[i]].length;
+    }
+    text.resize((size_t)length);
+
+    std::vector<char> run;
+    size_t filled = 0;
+    for (size_t first = 0; first < count;) {
+        const PackChunk& start = pack.chunks[numbers[first]];
+        size_t last = first;
+        while (last + 1 < count && numbers[last + 1] == numbers[last] + 1 &&
+            pack.chunks[numbers[last + 1]].offset + pack.chunks[numbers[last + 1]].stored - start.offset <= COMMIT_PACK_READ_BYTES)
+            last++;
+        const PackChunk& stop = pack.chunks[numbers[last]];
+        run.resize((size_t)(stop.offset + stop.stored - start.offset));
+
+        OVERLAPPED at = {};
+        at.Offset = (DWORD)start.offset;
+        at.OffsetHigh = (DWORD)(start.offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(pack.file, run.data(), (DWORD)run.size(), &read, &at) || read != run.size()) return false;
+        for (size_t i = first; i <= last; i++) {
+            const PackChunk& chunk = pack.chunks[numbers[i]];
+            const char* bytes = run.data() + (chunk.offset - start.offset);
+            if (chunk.stored == chunk.length) {
+                if (chunk.length > 0) memcpy(&text[filled], bytes, chunk.length);
+            }
+            else if (!decompressBlock(bytes, chunk.stored, &text[filled], chunk.length)) {
+                return false;
+            }
+            filled += chunk.length;
+        }
+        first = last + 1;
+    }
+    return true;
+}
+
+
+// Reads a commit's snapshot by putting its chunks back together. Returns false when the commit is not
+// in the pack or its snapshot cannot be rebuilt.
+bool readPackedSnapshot(const CommitPack& pack, int commitNumber, std::string& snapshot) {
+    std::vector<uint32_t> numbers;
+    bool read = readPackedRecipe(pack, commitNumber, numbers) && readPackedChunks(pack, numbers.data(), numbers.size(), snapshot);
+    if (!read) snapshot.clear();
+    return read;
+}
+
+
+// Cuts text down to lineCount lines from after the first skip line breaks
+void keepTextLines(std::string& text, size_t skip, size_t lineCount) {
+    size_t start = 0;
+    for (; skip > 0 && start < text.size(); skip--) {
+        size_t lineEnd = text.find('\n', start);
+        start = lineEnd == std::string::npos ? text.size() : lineEnd + 1;
+    }
+    size_t stop = start;
+    for (; lineCount > 0 && stop < text.size(); lineCount--) {
+        size_t lineEnd = text.find('\n', stop);
+        stop = lineEnd == std::string::npos ? text.size() : lineEnd + 1;
+    }
+    text = text.substr(start, stop - start);
+}
+
+
+// Reads lineCount lines of a commit's snapshot from line firstLine on (the first line being 0), with
+// their line breaks. Only the chunks from the one the first line starts in to the one the last line
+// ends in are read. Returns false when the commit is not in the pack or its snapshot cannot be rebuilt.
+bool readPackedLines(const CommitPack& pack, int commitNumber, size_t firstLine, size_t lineCount, std::string& lines) {
+    lines.clear();
+    std::vector<uint32_t> numbers;
+    if (!readPackedRecipe(pack, commitNumber, numbers)) return false;
+    uint64_t lastLine = (uint64_t)firstLine + lineCount;   // the line break ending the range is the lastLine-th
+    uint64_t before = 0;                                   // line breaks ahead of chunk i
+    size_t first = numbers.size(), last = numbers.size();
+    for (size_t i = 0; i < numbers.size(); i++) {
+        if (numbers[i] >= pack.chunks.size()) return false;
+        const PackChunk& chunk = pack.chunks[numbers[i]];
+        if (first == numbers.size() && before + chunk.lines >= firstLine) first = i;
+        if (before + chunk.lines >= lastLine) {
+            last = i;
+            break;
+        }
+        before += chunk.lines;
+    }
+    if (first == numbers.size() || lineCount == 0) return true;
+    if (last == numbers.size()) last = numbers.size() - 1;
+    uint64_t skip = firstLine;
+    for (size_t i = 0; i < first; i++) skip -= pack.chunks[numbers[i]].lines;
+    if (!readPackedChunks(pack, numbers.data() + first, last - first + 1, lines)) return false;
+    keepTextLines(lines, (size_t)skip, lineCount);
+    return true;
+}
+
+
+// Chunks the pack is getting in the write being put together, numbered on from the pack's own.
+// Their offsets are into the write buffer until it is on disk.
+struct PackChunkBatch {
+    std::vector<std::pair<ContentHash, PackChunk>> chunks;
+    std::unordered_map<ContentHash, uint32_t, ContentHashHasher> numbers;
+};
+
+
+// Appends the chunks of text no earlier snapshot had, compressed, then the recipe for the text as commitNumber's
+// snapshot. Returns the entry for the recipe, with its offset into the buffer.
+PackEntry appendChunkedSnapshot(const CommitPack& pack, std::vector<char>& out, PackChunkBatch& batch,
+    int commitNumber, const std::string& text) {
+    std::string recipe, compressed;
+    for (size_t position = 0; position < text.size();) {
+        size_t length = findChunkEnd(text.data() + position, text.size() - position);
+        ContentHash hash = hashContent(text.data() + position, length);
+        uint32_t number;
+        auto known = pack.chunkNumbers.find(hash);
+        auto added = batch.numbers.find(hash);
+        if (known != pack.chunkNumbers.end()) {
+            number = known->second;
+        }
+        else if (added != batch.numbers.end()) {
+            number = added->second;
+        }
+        else {
+            number = (uint32_t)(pack.chunks.size() + batch.chunks.size());
+            PackChunkInfo info = { (uint32_t)length, (uint32_t)std::count(text.begin() + position, text.begin() + position + length, '\n') };
+            compressBlock(text.data() + position, length, compressed);
+            std::string record((const char*)&hash, sizeof(hash));
+            record.append((const char*)&info, sizeof(info));
+            if (compressed.size() < length) record.append(compressed);
+            else record.append(text, position, length);
+            size_t data = appendPackRecord(out, PACK_CHUNK, commitNumber, record);
+            PackChunk chunk = { data + sizeof(hash) + sizeof(info), (uint32_t)(record.size() - sizeof(hash) - sizeof(info)),
+                info.length, info.lines };
+            batch.chunks.push_back(std::make_pair(hash, chunk));
+            batch.numbers.insert(std::make_pair(hash, number));
+        }
+        recipe.append((const char*)&number, sizeof(number));
+        position += length;
+    }
+    size_t data = appendPackRecord(out, PACK_RECIPE, commitNumber, recipe);
+    PackEntry entry = { 0, data, (uint32_t)recipe.size(), true, 0 };
+    return entry;
+}
+
+
+// Adds a commit to the end of the pack in one write: its new chunks and recipe, then the diff summary,
+// content and message. When the pack already holds the commit's text, the commit only refers to it.
+// The commit number must be newer than every commit in the pack.
+bool appendPackedCommit(CommitPack& pack, int commitNumber, const std::string& snapshot,
+    const std::string& diff, const std::string& message) {
+    if (pack.file == INVALID_HANDLE_VALUE || commitNumber <= pack.lastCommit) return false;
+    std::vector<char> out;
+    out.reserve(5 * sizeof(PackRecordHeader) + sizeof(PackContent) + diff.size() + message.size());
+
+    PackContent content;
+    memset(&content, 0, sizeof(content));   // the padding goes to disk too
+    content.hash = hashContent(snapshot);
+    content.owner = commitNumber;
+    auto known = pack.owners.find(content.hash);
+    if (known != pack.owners.end()) content.owner = known->second;
+    bool owns = content.owner == commitNumber;
+
+    PackChunkBatch batch;
+    PackEntry entry = { 0, 0, 0, true, owns ? 0 : content.owner };
+    if (owns) entry = appendChunkedSnapshot(pack, out, batch, commitNumber, snapshot);
+    appendPackRecord(out, PACK_DIFF, commitNumber, diff);
+    appendPackRecord(out, PACK_CONTENT, commitNumber, (const char*)&content, sizeof(content));
+    appendPackRecord(out, PACK_MESSAGE, commitNumber, message);
+
+    OVERLAPPED at = {};
+    at.Offset = (DWORD)pack.end;
+    at.OffsetHigh = (DWORD)(pack.end >> 32);
+    DWORD written = 0;
+    if (!WriteFile(pack.file, out.data(), (DWORD)out.size(), &written, &at) || written != out.size()) return false;
+
+    // Offsets into the buffer become offsets into the pack
+    for (auto& chunk : batch.chunks) {
+        chunk.second.offset += pack.end;
+        pack.chunkNumbers.insert(std::make_pair(chunk.first, (uint32_t)pack.chunks.size()));
+        pack.chunks.push_back(chunk.second);
+    }
+    if (owns) {
+        entry.recipe += pack.end;
+        pack.owners.insert(std::make_pair(content.hash, commitNumber));
+    }
+    entry.offset = pack.end;
+    if ((int)pack.entries.size() <= commitNumber) pack.entries.resize(commitNumber + 1, PackEntry());
+    pack.entries[commitNumber] = entry;
+    pack.lastCommit = commitNumber;
+    pack.end += out.size();
+    return true;
+}
+
+
+// Cuts every commit newer than lastKept off the end of the pack, which is what a rollback needs
+bool truncateCommitPack(CommitPack& pack, int lastKept) {
+    if (lastKept >= pack.lastCommit) return true;
+    int first = std::max(lastKept + 1, 1);
+    while (first <= pack.lastCommit && !pack.contains(first)) first++;
+    uint64_t end = (first <= pack.lastCommit) ? pack.entries[first].offset : pack.end;
+    int newest = std::min(lastKept, (int)pack.entries.size() - 1);
+    while (newest > 0 && !pack.contains(newest)) newest--;
+
+    LARGE_INTEGER at;
+    at.QuadPart = (LONGLONG)end;
+    if (!SetFilePointerEx(pack.file, at, NULL, FILE_BEGIN) || !SetEndOfFile(pack.file)) return false;
+    pack.entries.resize(std::max(lastKept + 1, 0));
+    pack.end = end;
+    pack.lastCommit = newest;
+
+    // Forget the snapshots and chunks cut off
+    for (auto owner = pack.owners.begin(); owner != pack.owners.end();) {
+        if (owner->second > newest) owner = pack.owners.erase(owner);
+        else ++owner;
+    }
+    size_t chunks = pack.chunks.size();
+    while (chunks > 0 && pack.chunks[chunks - 1].offset >= end) chunks--;
+    pack.chunks.resize(chunks);
+    for (auto chunk = pack.chunkNumbers.begin(); chunk != pack.chunkNumbers.end();) {
+        if (chunk->second >= chunks) chunk = pack.chunkNumbers.erase(chunk);
+        else ++chunk;
+    }
+    return true;
+}
@@ -4,6 +4,21 @@
 #include <windows.h>
 #include <algorithm>
 #include <vector>
+#include <cstdint>
+#include <climits>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <new>
+#include <bitset>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define COMMIT_TREE_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 #undef max
 
 // Relevant information stored in a commit
@@ -15,31 +30,362 @@ struct CommitInfo {
 };
 
 
-// Forward declerations
-struct CommitNode;
+// Append-only array that reader threads can index while the writer appends. Elements live in fixed
+// size chunks that never move, and a full chunk directory is replaced by a bigger copy instead of being
+// reallocated in place, so a reader holding the old directory still sees valid chunks. Old directories
+// are kept until clear(), which (like the destructor) must only run once no reader can reach the array.
+// Chunks come from the heap unless a chunkSource hands out memory elsewhere, e.g. in a mapped file.
+template <typename T, uint32_t ChunkBits>
+struct ChunkedArray {
+    static const uint32_t CHUNK_SIZE = 1u << ChunkBits;
 
+    std::atomic<T**> directory;
+    std::atomic<uint32_t> count;
+    uint32_t directoryCapacity;
+    uint32_t chunksAttached;
+    std::vector<std::unique_ptr<T*[]>> directories;   // current directory last
+    std::vector<std::unique_ptr<T[]>> chunks;         // chunks owned by the array
+    std::function<T*(uint32_t chunk)> chunkSource;    // raw memory for a new chunk, nullptr to use the heap
 
-// The "Mods" Stored in the Partially persistent AVL Tree
-struct ModificationRecord {
-    enum Field { LEFT, RIGHT, HEIGHT };
-    int version;      // commit
-    Field field;
-    std::shared_ptr<CommitNode> newChild;
-    int newHeight;
+    ChunkedArray() : directory(nullptr), count(0), directoryCapacity(0), chunksAttached(0) {}
+    ChunkedArray(const ChunkedArray&) = delete;
+    ChunkedArray& operator=(const ChunkedArray&) = delete;
 
-    // default constructor
-    ModificationRecord()
-        : version(0), field(LEFT), newChild(nullptr), newHeight(0) {
+    // Adds a default constructed element and returns its index. Readers find it once it is linked
+    // from something they already see (a published root, a node field), not through size(). The slot
+    // is constructed here and not only with its chunk: in a reopened image the chunk may still hold
+    // what an update that was never synced left in it.
+    uint32_t append() {
+        uint32_t index = count.load(std::memory_order_relaxed);
+        if ((index & (CHUNK_SIZE - 1)) == 0) addChunk(index >> ChunkBits);
+        new (&at(index)) T();
+        count.store(index + 1, std::memory_order_release);
+        return index;
     }
 
-    // pointer modifications
-    ModificationRecord(int ver, Field f, std::shared_ptr<CommitNode> child)
-        : version(ver), field(f), newChild(child), newHeight(0) {
+    // Adds an element that becomes visible to readers through size()
+    void push_back(const T& value) {
+        uint32_t index = count.load(std::memory_order_relaxed);
+        if ((index & (CHUNK_SIZE - 1)) == 0) addChunk(index >> ChunkBits);
+        at(index) = value;
+        count.store(index + 1, std::memory_order_release);
     }
 
-    // height modification
-    ModificationRecord(int ver, Field f, int h)
-        : version(ver), field(f), newChild(nullptr), newHeight(h) {
+    // Adds a run of elements, which may span chunks, and publishes them together
+    void append(const T* values, uint32_t length) {
+        uint32_t index = count.load(std::memory_order_relaxed);
+        for (uint32_t done = 0; done < length;) {
+            uint32_t offset = (index + done) & (CHUNK_SIZE - 1);
+            if (offset == 0) addChunk((index + done) >> ChunkBits);
+            uint32_t run = std::min(length - done, CHUNK_SIZE - offset);
+            std::copy(values + done, values + done + run, &at(index + done));
+            done += run;
+        }
+        count.store(index + length, std::memory_order_release);
+    }
+
+    // Copies elements [first, first + length) out, chunk by chunk
+    void read(uint32_t first, uint32_t length, T* out) const {
+        for (uint32_t done = 0; done < length;) {
+            uint32_t offset = (first + done) & (CHUNK_SIZE - 1);
+            uint32_t run = std::min(length - done, CHUNK_SIZE - offset);
+            const T* chunk = &at(first + done);
+            std::copy(chunk, chunk + run, out + done);
+            done += run;
+        }
+    }
+
+    T& operator[](uint32_t index) { return at(index); }
+    const T& operator[](uint32_t index) const { return at(index); }
+
+    uint32_t size() const { return count.load(std::memory_order_acquire); }
+
+    size_t chunkCount() const { return chunksAttached; }
+
+    size_t bytesReserved() const { return chunksAttached * (size_t)CHUNK_SIZE * sizeof(T); }
+
+    T* chunk(uint32_t index) const { return directory.load(std::memory_order_acquire)[index]; }
+
+    // Places an already constructed chunk (one loaded from a file) at the given chunk index.
+    // Together with resize() this rebuilds an array around memory the array does not own.
+    void attach(uint32_t index, T* data) {
+        if (index >= directoryCapacity) {
+            uint32_t capacity = std::max(16u, directoryCapacity);
+            while (capacity <= index) capacity *= 2;
+            std::unique_ptr<T*[]> bigger(new T*[capacity]());
+            if (directoryCapacity > 0)
+                std::copy(directories.back().get(), directories.back().get() + directoryCapacity, bigger.get());
+            directories.push_back(std::move(bigger));
+            directoryCapacity = capacity;
+            directory.store(directories.back().get(), std::memory_order_release);
+        }
+        directories.back()[index] = data;
+        chunksAttached++;
+    }
+
+    void resize(uint32_t size) { count.store(size, std::memory_order_release); }
+
+    void clear() {
+        directory.store(nullptr, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        directoryCapacity = 0;
+        chunksAttached = 0;
+        directories.clear();
+        chunks.clear();
+        chunkSource = nullptr;
+    }
+
+private:
+    T& at(uint32_t index) const {
+        return directory.load(std::memory_order_acquire)[index >> ChunkBits][index & (CHUNK_SIZE - 1)];
+    }
+
+    void addChunk(uint32_t index) {
+        T* data = chunkSource ? chunkSource(index) : nullptr;
+        if (data != nullptr) {
+            for (uint32_t i = 0; i < CHUNK_SIZE; i++) new (data + i) T();
+        }
+        else {
+            chunks.emplace_back(new T[CHUNK_SIZE]());
+            data = chunks.back().get();
+        }
+        attach(index, data);
+    }
+};
+
+
+// Where an interned string lives in the pool's character heap
+struct StringSpan {
+    uint32_t offset;
+    uint32_t length;
+};
+
+
+// Interning pool for payload strings. Each distinct string is stored once in a flat character heap and
+// referenced by a 32-bit id, so repeated diff summaries or messages cost one index per commit. The heap
+// holds no pointers, so it can be written to disk and mapped back as is (see CommitImage.h).
+struct StringPool {
+    ChunkedArray<wchar_t, 15> chars;
+    ChunkedArray<StringSpan, 14> strings;            // id -> span in chars
+    std::unordered_multimap<size_t, uint32_t> ids;   // string hash -> id, covers ids [0, indexed)
+    uint32_t indexed;
+
+    StringPool() : indexed(0) {}
+
+    uint32_t intern(const std::wstring& str) {
+        // Strings mapped in from an image are only hashed once something new has to be interned
+        for (; indexed < strings.size(); indexed++)
+            ids.emplace(std::hash<std::wstring>()(get(indexed)), indexed);
+
+        size_t hash = std::hash<std::wstring>()(str);
+        auto range = ids.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+            if (get(it->second) == str) return it->second;
+
+        StringSpan span = { chars.size(), (uint32_t)str.size() };
+        chars.append(str.data(), span.length);
+        strings.push_back(span);
+        ids.emplace(hash, indexed);
+        return indexed++;
+    }
+
+    std::wstring get(uint32_t id) const {
+        StringSpan span = strings[id];
+        std::wstring str(span.length, L'\0');
+        if (span.length > 0) chars.read(span.offset, span.length, &str[0]);
+        return str;
+    }
+
+    void clear() {
+        chars.clear();
+        strings.clear();
+        ids.clear();
+        indexed = 0;
+    }
+};
+
+
+// Interned strings of one commit
+struct CommitPayload {
+    uint32_t fileName;
+    uint32_t diffData;
+    uint32_t commitMessage;
+};
+
+
+// Append-only store for commit payloads. Tree nodes only hold an index into it, so node copies
+// never touch the strings and the nodes stay small enough for searches to be cache friendly.
+struct CommitPayloadStore {
+    StringPool strings;
+    ChunkedArray<CommitPayload, 14> payloads;
+
+    uint32_t add(const std::wstring& fileName, const std::wstring& diffData, const std::wstring& commitMessage) {
+        CommitPayload payload;
+        payload.fileName = strings.intern(fileName);
+        payload.diffData = strings.intern(diffData);
+        payload.commitMessage = strings.intern(commitMessage);
+        payloads.push_back(payload);
+        return payloads.size() - 1;
+    }
+
+    void clear() {
+        strings.clear();
+        payloads.clear();
+    }
+};
+
+
+// Nodes are addressed by 32-bit handles into a CommitArena instead of shared_ptrs, 0 is the null handle
+typedef uint32_t NodeRef;
+const NodeRef NULL_NODE = 0;
+
+
+// Number of mod slots per field of a fat node. Can be overridden at compile time to tune the
+// trade-off between node size and how often nodes have to be copied.
+#ifndef COMMIT_TREE_MAX_MODS
+#define COMMIT_TREE_MAX_MODS 4
+#endif
+
+
+// Instruction set the mod list lookups use, picked once at startup from what the CPU supports.
+// Set g_commitSimd to COMMIT_SIMD_SCALAR to force the plain search, e.g. to compare the two.
+enum CommitSimdLevel { COMMIT_SIMD_SCALAR, COMMIT_SIMD_SSE2, COMMIT_SIMD_AVX2 };
+
+
+#ifdef COMMIT_TREE_SSE2
+#ifdef __GNUC__
+#define COMMIT_TREE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define COMMIT_TREE_TARGET_AVX2
+#endif
+
+// The lane loads also read slots the writer may be filling in. Those lanes are masked off by the
+// published count, so the race is benign; keep thread sanitizer builds from reporting it.
+#ifdef __SANITIZE_THREAD__
+#define COMMIT_TREE_RACY_LOAD __attribute__((no_sanitize_thread))
+#else
+#define COMMIT_TREE_RACY_LOAD
+#endif
+
+
+CommitSimdLevel detectCommitSimd() {
+#ifdef _MSC_VER
+    // AVX2 needs the CPU feature and the OS saving the YMM registers on context switches
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return COMMIT_SIMD_SSE2;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return COMMIT_SIMD_SSE2;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) ? COMMIT_SIMD_AVX2 : COMMIT_SIMD_SSE2;
+#else
+    __builtin_cpu_init();   // we run from a static initializer
+    return __builtin_cpu_supports("avx2") ? COMMIT_SIMD_AVX2 : COMMIT_SIMD_SSE2;
+#endif
+}
+
+
+// Bit i is set when versions[i] is past the version, for 4 and 8 lanes
+COMMIT_TREE_RACY_LOAD int laterLanes4(const int* versions, int version) {
+    __m128i lanes = _mm_loadu_si128((const __m128i*)versions);
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(lanes, _mm_set1_epi32(version))));
+}
+
+
+COMMIT_TREE_RACY_LOAD COMMIT_TREE_TARGET_AVX2 int laterLanes8(const int* versions, int version) {
+    __m256i lanes = _mm256_loadu_si256((const __m256i*)versions);
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(lanes, _mm256_set1_epi32(version))));
+}
+
+
+int lowestSetBit(uint32_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+CommitSimdLevel g_commitSimd = detectCommitSimd();
+#else
+CommitSimdLevel g_commitSimd = COMMIT_SIMD_SCALAR;
+#endif
+
+
+// Number of the first count entries of a sorted version array that are <= the version.
+// Lists whose capacity is a multiple of 4 are compared whole, 4 or 8 lanes per instruction:
+// versions are sorted, so the lanes past the version form a suffix, and with the unused lanes
+// past count added to it the answer is the index of its first lane.
+template <int MaxMods>
+int versionsUpTo(const int* versions, int count, int version) {
+#ifdef COMMIT_TREE_SSE2
+    if (MaxMods % 4 == 0 && MaxMods <= 32 && g_commitSimd != COMMIT_SIMD_SCALAR) {
+        uint64_t later = 0;
+        int lane = 0;
+        if (g_commitSimd == COMMIT_SIMD_AVX2) {
+            for (; lane + 8 <= MaxMods; lane += 8)
+                later |= (uint64_t)laterLanes8(versions + lane, version) << lane;
+        }
+        for (; lane < MaxMods; lane += 4)
+            later |= (uint64_t)laterLanes4(versions + lane, version) << lane;
+        later |= ~0ull << count;
+        if ((uint32_t)later == 0) return count;   // a full list of 32, every entry at or before the version
+        return lowestSetBit((uint32_t)later);
+    }
+#endif
+    // Checks the newest entry first and falls back to a binary search for older versions
+    if (count == 0 || version < versions[0]) return 0;
+    if (version >= versions[count - 1]) return count;
+    int lo = 0, hi = count - 1;   // versions[lo] <= version < versions[hi]
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (versions[mid] <= version) lo = mid;
+        else hi = mid;
+    }
+    return lo + 1;
+}
+
+
+// The node fields that can change after a node is created
+enum ModField { MOD_LEFT, MOD_RIGHT, MOD_HEIGHT, MOD_LEFT_SIZE };
+
+
+// The "Mods" Stored in the Partially persistent AVL Tree, one list per field, versions and values in
+// arrays of their own so a lookup only reads the versions (see versionsUpTo). Only the newest version
+// is ever written, so entries are appended in version order and stay sorted.
+// The count is published last, so a reader on another thread sees either the old or the new list.
+template <typename T, int MaxMods>
+struct ModificationList {
+    int versions[MaxMods];
+    T values[MaxMods];
+    std::atomic<int> count;
+
+    ModificationList() : count(0) {}
+
+    int size() const { return count.load(std::memory_order_acquire); }
+
+    // Value of the field as of the version, or the node's own value if it had not changed by then
+    T resolve(T original, int version) const {
+        int applied = versionsUpTo<MaxMods>(versions, size(), version);
+        return (applied == 0) ? original : values[applied - 1];
+    }
+
+    // Records a change for the newest version, replacing an earlier change from the same version.
+    // Returns false when a new slot is needed and the list is full.
+    bool record(int version, T value) {
+        int count = this->count.load(std::memory_order_relaxed);
+        if (count > 0 && versions[count - 1] == version) {
+            values[count - 1] = value;
+            return true;
+        }
+        if (count == MaxMods) return false;
+        versions[count] = version;
+        values[count] = value;
+        this->count.store(count + 1, std::memory_order_release);
+        return true;
     }
 };
 
@@ -47,237 +393,1838 @@ struct ModificationRecord {
 // A commit node in the partially persistent AVL tree. Uses fat node approach from Driscoll with a fixed mod list
 struct CommitNode {
     int commitCounter;
-    std::wstring fileName;
-    std::wstring diffData;
-    std::wstring commitMessage;
+    uint32_t payload; // index into the tree's CommitPayloadStore
+    int version;      // version that created this node
+
+    // Newest value of every field, indexed by ModField, next to the commit number so reading the head
+    // version costs one cache line and no mod list lookup. newestSince is the last version any field
+    // was written in, the copy answers every version from there on (see readNewest).
+    std::atomic<int> newestSince;
+    std::atomic<uint32_t> newest[4];
+
     int height;
-    std::shared_ptr<CommitNode> left;
-    std::shared_ptr<CommitNode> right;
+    int leftSize;     // number of commits in the left subtree, for rank/select. Appends never change it
+    NodeRef left;
+    NodeRef right;
+
+    // Back pointer to the parent in the newest version. Only the newest version is ever modified,
+    // so this is what lets a node copy be linked into its parent without walking down from the root.
+    NodeRef parent;
 
     // Fat node fields
-    static const int MAX_MODS = 5;
-    ModificationRecord mods[MAX_MODS];
-    int modCount;
+    static const int MAX_MODS = COMMIT_TREE_MAX_MODS;
+    ModificationList<NodeRef, MAX_MODS> leftMods;
+    ModificationList<NodeRef, MAX_MODS> rightMods;
+    ModificationList<int, MAX_MODS> heightMods;
+    ModificationList<int, MAX_MODS> leftSizeMods;
 
-    CommitNode(int counter, const std::wstring& fname, const std::wstring& diff = L"", const std::wstring& msg = L"")
-        : commitCounter(counter), fileName(fname), diffData(diff), commitMessage(msg),
-        height(1), left(nullptr), right(nullptr), modCount(0) {
+    CommitNode()
+        : commitCounter(0), payload(0), version(0), newestSince(0), height(1), leftSize(0), left(NULL_NODE), right(NULL_NODE), parent(NULL_NODE) {
+        newest[MOD_LEFT].store(NULL_NODE, std::memory_order_relaxed);
+        newest[MOD_RIGHT].store(NULL_NODE, std::memory_order_relaxed);
+        newest[MOD_HEIGHT].store(1, std::memory_order_relaxed);
+        newest[MOD_LEFT_SIZE].store(0, std::memory_order_relaxed);
     }
 };
 
 
-// Return a node with most up to date fields based off mod list
-std::shared_ptr<CommitNode> getLeft(const std::shared_ptr<CommitNode>& node, int version) {
-    if (!node) return nullptr;
-    std::shared_ptr<CommitNode> result = node->left;
-    for (int i = 0; i < node->modCount; i++) {
-        if (node->mods[i].field == ModificationRecord::LEFT && node->mods[i].version <= version) {
-            result = node->mods[i].newChild;
-        }
+// Pool that owns every CommitNode. Nodes are stored in fixed size chunks that never reallocate,
+// so a handle (and any CommitNode pointer handed out for it) stays valid while the arena grows,
+// also for reader threads walking an older version at the same time
+struct CommitArena {
+    static const uint32_t CHUNK_BITS = 12;
+
+    ChunkedArray<CommitNode, CHUNK_BITS> nodes;
+
+    NodeRef allocate(int counter, uint32_t payload) {
+        uint32_t index = nodes.append();
+        CommitNode& node = nodes[index];
+        node.commitCounter = counter;
+        node.payload = payload;
+        return index + 1;   // handle = index + 1
+    }
+
+    CommitNode& operator[](NodeRef ref) { return nodes[ref - 1]; }
+
+    const CommitNode& operator[](NodeRef ref) const { return nodes[ref - 1]; }
+
+    size_t nodeCount() const { return nodes.size(); }
+
+    // Bytes reserved for node storage (payloads live in the CommitPayloadStore)
+    size_t bytesReserved() const { return nodes.bytesReserved(); }
+
+    void clear() { nodes.clear(); }
+};
+
+
+// Counters for the node-copying scheme. Over a run of commits, (modsRecorded + nodeCopies) / commits
+// stays bounded by a constant, which is the O(1) amortized space per update from Driscoll et al.
+struct CommitTreeStats {
+    uint64_t commits;        // insertNode calls
+    uint64_t deletions;      // commits removed by deleteNode / truncateCommits
+    uint64_t fieldUpdates;   // left/right/height/size writes made for the newest version
+    uint64_t modsRecorded;   // writes that used up a mod slot
+    uint64_t nodeCopies;     // writes that found the mod list full and copied the node
+
+    CommitTreeStats() : commits(0), deletions(0), fieldUpdates(0), modsRecorded(0), nodeCopies(0) {}
+};
+
+
+// Old history in a flat layout indexed by commit number: one presence bit per commit number from
+// first on, the number of commits in the words before each bitmap word, and the commits themselves in
+// order. Lookup, rank, select, successor and predecessor are all O(1). The freeze stage (see
+// CommitFreezer) only ever appends whole bitmap words, so everything a view covers stays immutable.
+struct FrozenHistory {
+    int first;                                  // commit number of bit 0
+    ChunkedArray<uint64_t, 10> present;
+    ChunkedArray<uint32_t, 10> presentBefore;   // presentBefore[w] = commits in words [0, w)
+    ChunkedArray<NodeRef, 14> commits;
+
+    FrozenHistory() : first(0) {}
+};
+
+
+// From version on, commits up to and including through are answered by the history instead of the tree.
+// The tree still holds them, older versions and the mapped image share its nodes.
+struct FrozenView {
+    int version;
+    FrozenHistory* history;
+    int through;
+};
+
+
+// A version anywhere in the history: a version of a branch, where branch 0 is the main line
+struct CommitVersion {
+    int branch;
+    int version;
+};
+
+
+// A line of versions started from another version, which makes the history a tree of versions instead
+// of a single line. Nodes shared with the main line are read as of base, the main line version the
+// branch (or the branch it forked from) started at. The branch's own nodes are made with all their
+// fields and never changed afterwards, so reading them as of base works too. Branches live in memory
+// only, an image (CommitImage.h) holds the main line.
+struct CommitBranch {
+    CommitVersion forkedFrom;
+    int base;
+    ChunkedArray<NodeRef, 10> roots;   // roots[i] = root as of version i, 0 is the version it forked from
+
+    CommitBranch() : base(0) {
+        forkedFrom.branch = 0;
+        forkedFrom.version = 0;
+    }
+};
+
+
+// The persistent commit tree: the node arena, the root of the newest version and a directory
+// with the root of every older version, so a query for version v starts from v's own root.
+// root is the writer's working root; readers only start from versionRoots, whose size is the
+// point where a finished version becomes visible to other threads.
+struct CommitImage;
+struct CommitTree {
+    std::shared_ptr<CommitImage> image;   // file the arrays below live in when the tree is mapped (CommitImage.h)
+    int* imageWritten;                    // word of the image's header an update marks before it writes, or null
+    CommitArena nodes;
+    CommitPayloadStore payloads;
+    NodeRef root;
+    NodeRef rightmost;   // newest commit in the newest version, where the next commit is attached
+    ChunkedArray<NodeRef, 14> versionRoots;   // versionRoots[v] = root as of version v, 0 is the empty tree
+    ChunkedArray<CommitBranch, 6> branches;   // branches[0] stands for the main line, whose roots are versionRoots
+    ChunkedArray<FrozenView, 8> frozenViews;  // ordered by version, readers binary search it
+    std::vector<std::unique_ptr<FrozenHistory>> frozenHistories;   // what the views point into, writer only
+    int lowestEdit;   // lowest commit number touched since the running freeze started, writer only
+    CommitTreeStats stats;
+
+    CommitTree() : imageWritten(nullptr), root(NULL_NODE), rightmost(NULL_NODE), lowestEdit(INT_MAX) {
+        versionRoots.push_back(NULL_NODE);
+        branches.append();
+    }
+
+    bool empty() const { return root == NULL_NODE; }
+
+    int headVersion() const { return (int)versionRoots.size() - 1; }
+
+    void clear() {
+        nodes.clear();
+        payloads.clear();
+        root = NULL_NODE;
+        rightmost = NULL_NODE;
+        versionRoots.clear();
+        versionRoots.push_back(NULL_NODE);
+        branches.clear();
+        branches.append();
+        frozenViews.clear();
+        frozenHistories.clear();
+        lowestEdit = INT_MAX;
+        stats = CommitTreeStats();
+        image.reset();   // a cleared tree lives on the heap
+        imageWritten = nullptr;
+    }
+};
+
+
+// A read-only handle on the tree exactly as it was at one version
+struct CommitSnapshot {
+    const CommitTree* tree;
+    NodeRef root;
+    int version;
+    const FrozenHistory* frozen;   // answers commits <= frozenThrough, nullptr when nothing is frozen
+    int frozenThrough;
+};
+
+
+// How often a field read was answered by a node's newest values rather than its mod list. Only counted
+// when COMMIT_TREE_CACHE_COUNTERS is defined, the shared counters would otherwise slow down every read.
+struct CommitCacheCounters {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+
+    CommitCacheCounters() : hits(0), misses(0) {}
+
+    double hitRate() const {
+        uint64_t total = hits.load() + misses.load();
+        return total ? (double)hits.load() / total : 0.0;
+    }
+};
+CommitCacheCounters g_commitCache;
+
+
+// Reads a field from the node's newest values. Fails when the node was written after the version, or is
+// being written while we read (the writer bumps newestSince before it changes a value, seqlock style),
+// and the mod list has to answer instead.
+bool readNewest(const CommitNode& node, ModField field, int version, uint32_t& value) {
+    int since = node.newestSince.load(std::memory_order_acquire);
+    bool hit = since <= version;
+    if (hit) {
+        // A value stored after newestSince was bumped makes the bump visible to the second check
+        value = node.newest[field].load(std::memory_order_acquire);
+        hit = node.newestSince.load(std::memory_order_relaxed) == since;
     }
-    return result;
+#ifdef COMMIT_TREE_CACHE_COUNTERS
+    (hit ? g_commitCache.hits : g_commitCache.misses).fetch_add(1, std::memory_order_relaxed);
+#endif
+    return hit;
 }
 
 
 // Return a node with most up to date fields based off mod list
-std::shared_ptr<CommitNode> getRight(const std::shared_ptr<CommitNode>& node, int version) {
-    if (!node) return nullptr;
-    std::shared_ptr<CommitNode> result = node->right;
-    for (int i = 0; i < node->modCount; i++) {
-        if (node->mods[i].field == ModificationRecord::RIGHT && node->mods[i].version <= version) {
-            result = node->mods[i].newChild;
-        }
-    }
-    return result;
+NodeRef getLeft(const CommitArena& arena, NodeRef ref, int version) {
+    if (ref == NULL_NODE) return NULL_NODE;
+    const CommitNode& node = arena[ref];
+    uint32_t value;
+    if (readNewest(node, MOD_LEFT, version, value)) return value;
+    return node.leftMods.resolve(node.left, version);
+}
+
+
+// Return a node with most up to date fields based off mod list
+NodeRef getRight(const CommitArena& arena, NodeRef ref, int version) {
+    if (ref == NULL_NODE) return NULL_NODE;
+    const CommitNode& node = arena[ref];
+    uint32_t value;
+    if (readNewest(node, MOD_RIGHT, version, value)) return value;
+    return node.rightMods.resolve(node.right, version);
 }
 
 
 // Return height of node using mod list to get most up to date information
-int getHeight(const std::shared_ptr<CommitNode>& node, int version) {
-    if (!node) return 0;
-    int result = node->height;
-    for (int i = 0; i < node->modCount; i++) {
-        if (node->mods[i].field == ModificationRecord::HEIGHT && node->mods[i].version <= version) {
-            result = node->mods[i].newHeight;
-        }
-    }
-    return result;
+int getHeight(const CommitArena& arena, NodeRef ref, int version) {
+    if (ref == NULL_NODE) return 0;
+    const CommitNode& node = arena[ref];
+    uint32_t value;
+    if (readNewest(node, MOD_HEIGHT, version, value)) return (int)value;
+    return node.heightMods.resolve(node.height, version);
 }
 
 
-// full mod list triggers a new node and leaves old node alone
-std::shared_ptr<CommitNode> copyFullNode(const std::shared_ptr<CommitNode>& node, int version) {
-    if (!node) return nullptr;
-    auto newNode = std::make_shared<CommitNode>(node->commitCounter, node->fileName, node->diffData, node->commitMessage);
-    newNode->left = getLeft(node, version);
-    newNode->right = getRight(node, version);
-    newNode->height = getHeight(node, version);
-    newNode->modCount = 0;
-    return newNode;
+// Return the number of commits in the left subtree of a node as of the version
+int getLeftSize(const CommitArena& arena, NodeRef ref, int version) {
+    if (ref == NULL_NODE) return 0;
+    const CommitNode& node = arena[ref];
+    uint32_t value;
+    if (readNewest(node, MOD_LEFT_SIZE, version, value)) return (int)value;
+    return node.leftSizeMods.resolve(node.leftSize, version);
 }
 
 
-// updates the left child node, triggers a copy if mod list is full
-std::shared_ptr<CommitNode> updateLeft(const std::shared_ptr<CommitNode>& node,
-    const std::shared_ptr<CommitNode>& newLeft, int version) {
-    if (!node) return nullptr;
-    if (node->modCount < CommitNode::MAX_MODS) {
-        node->mods[node->modCount] = ModificationRecord(version, ModificationRecord::LEFT, newLeft);
-        node->modCount++;
-        return node;
+// Number of mod slots in use across all fields of a node
+int modCount(const CommitNode& node) {
+    return node.leftMods.size() + node.rightMods.size() + node.heightMods.size() + node.leftSizeMods.size();
+}
+
+
+// Writes a value straight into a node's own fields, bypassing the mod list
+void setOriginalField(CommitNode& node, ModField field, NodeRef child, int value) {
+    if (field == MOD_LEFT) node.left = child;
+    else if (field == MOD_RIGHT) node.right = child;
+    else if (field == MOD_HEIGHT) node.height = value;
+    else node.leftSize = value;
+}
+
+
+// Makes a value the newest one of a field, as of the version being written
+void cacheNewest(CommitNode& node, ModField field, uint32_t value, int version) {
+    node.newestSince.store(version, std::memory_order_relaxed);
+    node.newest[field].store(value, std::memory_order_release);
+}
+
+
+// For a node built in the version being written, whose own fields are its newest ones
+void cacheOriginals(CommitNode& node) {
+    node.newestSince.store(node.version, std::memory_order_relaxed);
+    node.newest[MOD_LEFT].store(node.left, std::memory_order_relaxed);
+    node.newest[MOD_RIGHT].store(node.right, std::memory_order_relaxed);
+    node.newest[MOD_HEIGHT].store(node.height, std::memory_order_relaxed);
+    node.newest[MOD_LEFT_SIZE].store(node.leftSize, std::memory_order_relaxed);
+}
+
+
+// Hooks a (possibly new) child under a parent at the newest version and fixes its back pointer
+NodeRef updateLeft(CommitTree& tree, NodeRef ref, NodeRef newLeft, int version);
+NodeRef updateRight(CommitTree& tree, NodeRef ref, NodeRef newRight, int version);
+
+
+// full mod list triggers a new node and leaves old node alone. The copy takes over the old node's
+// place in the newest version: its children point back to it and its parent (or the root) points to it,
+// which may in turn overflow the parent and propagate one level further up.
+NodeRef copyFullNode(CommitTree& tree, NodeRef ref, ModField field, NodeRef child, int value, int version) {
+    CommitArena& arena = tree.nodes;
+    const CommitNode& node = arena[ref];
+    NodeRef newRef = arena.allocate(node.commitCounter, node.payload);
+    tree.stats.nodeCopies++;
+
+    CommitNode& newNode = arena[newRef];
+    newNode.version = version;
+    newNode.left = getLeft(arena, ref, version);
+    newNode.right = getRight(arena, ref, version);
+    newNode.height = getHeight(arena, ref, version);
+    newNode.leftSize = getLeftSize(arena, ref, version);
+    newNode.parent = node.parent;
+    setOriginalField(newNode, field, child, value);
+    cacheOriginals(newNode);
+
+    if (newNode.left != NULL_NODE) arena[newNode.left].parent = newRef;
+    if (newNode.right != NULL_NODE) arena[newNode.right].parent = newRef;
+
+    NodeRef parent = newNode.parent;
+    if (parent != NULL_NODE) {
+        if (getLeft(arena, parent, version) == ref)
+            updateLeft(tree, parent, newRef, version);
+        else
+            updateRight(tree, parent, newRef, version);
     }
-    else {
-        auto newNode = copyFullNode(node, version);
-        newNode->left = newLeft;
-        return newNode;
+    else if (tree.root == ref) {
+        tree.root = newRef;
     }
+    if (tree.rightmost == ref) tree.rightmost = newRef;
+    return newRef;
 }
 
 
-// updates the right child node, triggers a copy if mod list is full
-std::shared_ptr<CommitNode> updateRight(const std::shared_ptr<CommitNode>& node,
-    const std::shared_ptr<CommitNode>& newRight, int version) {
-    if (!node) return nullptr;
-    if (node->modCount < CommitNode::MAX_MODS) {
-        node->mods[node->modCount] = ModificationRecord(version, ModificationRecord::RIGHT, newRight);
-        node->modCount++;
-        return node;
+// Records a field change for the newest version. Returns the node that now holds the field,
+// which is a fresh copy when the mod list was already full.
+NodeRef updateField(CommitTree& tree, NodeRef ref, ModField field, NodeRef child, int value, int version) {
+    if (ref == NULL_NODE) return NULL_NODE;
+    tree.stats.fieldUpdates++;
+    CommitNode& node = tree.nodes[ref];
+
+    // Nodes created in this version are invisible to older versions and can be changed in place
+    if (node.version == version) {
+        setOriginalField(node, field, child, value);
+        cacheNewest(node, field, (field == MOD_LEFT || field == MOD_RIGHT) ? child : (uint32_t)value, version);
+        return ref;
     }
-    else {
-        auto newNode = copyFullNode(node, version);
-        newNode->right = newRight;
-        return newNode;
+
+    int usedBefore = modCount(node);
+    bool recorded;
+    if (field == MOD_LEFT) recorded = node.leftMods.record(version, child);
+    else if (field == MOD_RIGHT) recorded = node.rightMods.record(version, child);
+    else if (field == MOD_HEIGHT) recorded = node.heightMods.record(version, value);
+    else recorded = node.leftSizeMods.record(version, value);
+
+    if (recorded) {
+        tree.stats.modsRecorded += modCount(node) - usedBefore;
+        cacheNewest(node, field, (field == MOD_LEFT || field == MOD_RIGHT) ? child : (uint32_t)value, version);
+        return ref;
     }
+    return copyFullNode(tree, ref, field, child, value, version);
+}
+
+
+// updates the left child node, triggers a copy if mod list is full
+NodeRef updateLeft(CommitTree& tree, NodeRef ref, NodeRef newLeft, int version) {
+    ref = updateField(tree, ref, MOD_LEFT, newLeft, 0, version);
+    if (newLeft != NULL_NODE) tree.nodes[newLeft].parent = ref;
+    return ref;
+}
+
+
+// updates the right child node, triggers a copy if mod list is full
+NodeRef updateRight(CommitTree& tree, NodeRef ref, NodeRef newRight, int version) {
+    ref = updateField(tree, ref, MOD_RIGHT, newRight, 0, version);
+    if (newRight != NULL_NODE) tree.nodes[newRight].parent = ref;
+    return ref;
 }
 
 
 // updates the height of a node, triggers a copy if mod list is full
-std::shared_ptr<CommitNode> updateHeight(const std::shared_ptr<CommitNode>& node,
-    int version, int newHeight) {
-    if (!node) return nullptr;
-    if (node->modCount < CommitNode::MAX_MODS) {
-        node->mods[node->modCount] = ModificationRecord(version, ModificationRecord::HEIGHT, newHeight);
-        node->modCount++;
-        return node;
-    }
-    else {
-        auto newNode = copyFullNode(node, version);
-        newNode->height = newHeight;
-        return newNode;
-    }
+NodeRef updateHeight(CommitTree& tree, NodeRef ref, int version, int newHeight) {
+    return updateField(tree, ref, MOD_HEIGHT, NULL_NODE, newHeight, version);
+}
+
+
+// updates the left subtree size of a node, triggers a copy if mod list is full
+NodeRef updateLeftSize(CommitTree& tree, NodeRef ref, int version, int newLeftSize) {
+    return updateField(tree, ref, MOD_LEFT_SIZE, NULL_NODE, newLeftSize, version);
+}
+
+
+// Puts the new top of a rotated subtree where the old top used to be
+void replaceSubtree(CommitTree& tree, NodeRef parent, bool wasLeft, NodeRef newTop, int version) {
+    tree.nodes[newTop].parent = parent;
+    if (parent == NULL_NODE)
+        tree.root = newTop;
+    else if (wasLeft)
+        updateLeft(tree, parent, newTop, version);
+    else
+        updateRight(tree, parent, newTop, version);
 }
 
 
-// Perform a right rotation to rebalance tree, leaves old nodes as is and creates new nodes
-std::shared_ptr<CommitNode> rightRotate(const std::shared_ptr<CommitNode>& y, int version) {
-    auto x = copyFullNode(getLeft(y, version), version);
-    auto T2 = getRight(x, version);
-    auto newY = updateLeft(y, T2, version);
-    newY = updateHeight(newY, version, 1 + std::max(getHeight(getLeft(newY, version), version),
-        getHeight(getRight(newY, version), version)));
-    x = updateRight(x, newY, version);
-    x = updateHeight(x, version, 1 + std::max(getHeight(getLeft(x, version), version),
-        getHeight(getRight(x, version), version)));
+// Perform a right rotation to rebalance tree. Only the fields that change are recorded,
+// old versions keep seeing the unrotated subtree through the mod lists. Of the left sizes only y's
+// changes: it loses x and x's left subtree.
+NodeRef rightRotate(CommitTree& tree, NodeRef y, int version) {
+    CommitArena& arena = tree.nodes;
+    NodeRef x = getLeft(arena, y, version);
+    NodeRef T2 = getRight(arena, x, version);
+
+    // Detach x so that copying it below does not get propagated into y
+    arena[x].parent = NULL_NODE;
+    y = updateLeft(tree, y, T2, version);
+    y = updateHeight(tree, y, version, 1 + std::max(getHeight(arena, T2, version),
+        getHeight(arena, getRight(arena, y, version), version)));
+    y = updateLeftSize(tree, y, version, getLeftSize(arena, y, version) - getLeftSize(arena, x, version) - 1);
+
+    NodeRef parent = arena[y].parent;
+    bool wasLeft = parent != NULL_NODE && getLeft(arena, parent, version) == y;
+    arena[y].parent = NULL_NODE;
+    x = updateRight(tree, x, y, version);
+    x = updateHeight(tree, x, version, 1 + std::max(getHeight(arena, getLeft(arena, x, version), version),
+        getHeight(arena, y, version)));
+
+    replaceSubtree(tree, parent, wasLeft, x, version);
     return x;
 }
 
 
-// Performs a left rotation to rebalance tree
-std::shared_ptr<CommitNode> leftRotate(const std::shared_ptr<CommitNode>& x, int version) {
-    auto y = copyFullNode(getRight(x, version), version);
-    auto T2 = getLeft(y, version);
-    auto newX = updateRight(x, T2, version);
-    newX = updateHeight(newX, version, 1 + std::max(getHeight(getLeft(newX, version), version),
-        getHeight(getRight(newX, version), version)));
-    y = updateLeft(y, newX, version);
-    y = updateHeight(y, version, 1 + std::max(getHeight(getLeft(y, version), version),
-        getHeight(getRight(y, version), version)));
+// Performs a left rotation to rebalance tree. y's left subtree grows by x and x's left subtree.
+NodeRef leftRotate(CommitTree& tree, NodeRef x, int version) {
+    CommitArena& arena = tree.nodes;
+    NodeRef y = getRight(arena, x, version);
+    NodeRef T2 = getLeft(arena, y, version);
+
+    // Detach y so that copying it below does not get propagated into x
+    arena[y].parent = NULL_NODE;
+    x = updateRight(tree, x, T2, version);
+    x = updateHeight(tree, x, version, 1 + std::max(getHeight(arena, getLeft(arena, x, version), version),
+        getHeight(arena, T2, version)));
+
+    NodeRef parent = arena[x].parent;
+    bool wasLeft = parent != NULL_NODE && getLeft(arena, parent, version) == x;
+    arena[x].parent = NULL_NODE;
+    y = updateLeft(tree, y, x, version);
+    y = updateHeight(tree, y, version, 1 + std::max(getHeight(arena, x, version),
+        getHeight(arena, getRight(arena, y, version), version)));
+    y = updateLeftSize(tree, y, version, getLeftSize(arena, x, version) + 1 + getLeftSize(arena, y, version));
+
+    replaceSubtree(tree, parent, wasLeft, y, version);
     return y;
 }
 
 
-std::shared_ptr<CommitNode> insertNode(const std::shared_ptr<CommitNode>& root, int commitCounter,
-    const std::wstring& fileName, const std::wstring& diffData,
-    const std::wstring& commitMessage = L"") {
-    int version = commitCounter;  // Each new insertion uses its commit number as its version.
-    if (!root)
-        return std::make_shared<CommitNode>(commitCounter, fileName, diffData, commitMessage);
+// Records the current root as the root of the version being written (the one after the head),
+// which makes the version visible to reader threads
+void publishVersion(CommitTree& tree, int version) {
+    if (version <= tree.headVersion()) return;
+    tree.versionRoots.push_back(tree.root);
+}
+
+
+// Called by every update of the newest version before it writes to any node. In a mapped tree the
+// image then knows its nodes hold changes newer than its header covers, until the next sync.
+void beginUpdate(CommitTree& tree, int version) {
+    if (tree.imageWritten != nullptr) *tree.imageWritten = version;
+}
+
+
+// Called for every update before it changes anything: from the version being written on, the frozen
+// range stops short of the commit the update touches. Appends land above it and leave it alone.
+void thawFrozen(CommitTree& tree, int commitCounter, int version) {
+    tree.lowestEdit = std::min(tree.lowestEdit, commitCounter);
+    uint32_t views = tree.frozenViews.size();
+    if (views == 0 || tree.frozenViews[views - 1].through < commitCounter) return;
+    FrozenView view = tree.frozenViews[views - 1];
+    view.version = version;
+    view.through = commitCounter - 1;
+    tree.frozenViews.push_back(view);
+}
+
+
+// Links a new commit into the version being written, without publishing it (see insertNode)
+void attachCommit(CommitTree& tree, int commitCounter, uint32_t payload, int version) {
+    CommitArena& arena = tree.nodes;
+    NodeRef leaf = arena.allocate(commitCounter, payload);
+    arena[leaf].version = version;
+    if (tree.root == NULL_NODE) {
+        tree.root = leaf;
+        tree.rightmost = leaf;
+        return;
+    }
 
-    // Copy the root using its effective fields for the current version.
-    auto newRoot = copyFullNode(root, version);
-    if (commitCounter < newRoot->commitCounter) {
-        auto updatedLeft = insertNode(getLeft(newRoot, version), commitCounter, fileName, diffData, commitMessage);
-        newRoot = updateLeft(newRoot, updatedLeft, version);
+    NodeRef node;
+    if (commitCounter >= arena[tree.rightmost].commitCounter) {
+        // Commit numbers only grow, so nearly every commit is attached right below the newest one.
+        // No node gains anything on its left, so nothing is written on the way down and the
+        // whole insert is the O(1) amortized retrace below.
+        node = updateRight(tree, tree.rightmost, leaf, version);
+        tree.rightmost = leaf;
     }
     else {
-        auto updatedRight = insertNode(getRight(newRoot, version), commitCounter, fileName, diffData, commitMessage);
-        newRoot = updateRight(newRoot, updatedRight, version);
-    }
-    int newHeight = 1 + std::max(getHeight(getLeft(newRoot, version), version), getHeight(getRight(newRoot, version), version));
-    newRoot = updateHeight(newRoot, version, newHeight);
-
-    int balance = getHeight(getLeft(newRoot, version), version) - getHeight(getRight(newRoot, version), version);
-
-    // left left
-    if (balance > 1 && commitCounter < getLeft(newRoot, version)->commitCounter)
-        return rightRotate(newRoot, version);
-    // right right
-    if (balance < -1 && commitCounter >= getRight(newRoot, version)->commitCounter)
-        return leftRotate(newRoot, version);
-    // left right 
-    if (balance > 1 && commitCounter >= getLeft(newRoot, version)->commitCounter) {
-        auto updatedLeft = leftRotate(getLeft(newRoot, version), version);
-        newRoot = updateLeft(newRoot, updatedLeft, version);
-        return rightRotate(newRoot, version);
-    }
-    // right left 
-    if (balance < -1 && commitCounter < getRight(newRoot, version)->commitCounter) {
-        auto updatedRight = rightRotate(getRight(newRoot, version), version);
-        newRoot = updateRight(newRoot, updatedRight, version);
-        return leftRotate(newRoot, version);
-    }
-    return newRoot;
-}
-
-
-std::shared_ptr<CommitNode> searchCommit(const std::shared_ptr<CommitNode>& node, int targetCommit, int version) {
-    if (!node) return nullptr;
-    if (targetCommit == node->commitCounter)
-        return node;
-    else if (targetCommit < node->commitCounter)
-        return searchCommit(getLeft(node, version), targetCommit, version);
-    else
-        return searchCommit(getRight(node, version), targetCommit, version);
+        // Find the attachment point in the newest version. Every node the new commit goes left
+        // of gains one commit in its left subtree.
+        NodeRef parent = tree.root;
+        for (;;) {
+            NodeRef next;
+            if (commitCounter < arena[parent].commitCounter) {
+                parent = updateLeftSize(tree, parent, version, getLeftSize(arena, parent, version) + 1);
+                next = getLeft(arena, parent, version);
+            }
+            else {
+                next = getRight(arena, parent, version);
+            }
+            if (next == NULL_NODE) break;
+            parent = next;
+        }
+        node = (commitCounter < arena[parent].commitCounter)
+            ? updateLeft(tree, parent, leaf, version)
+            : updateRight(tree, parent, leaf, version);
+    }
+
+    // Retrace towards the root. We stop once a height is unchanged or after the single (double)
+    // rotation an AVL insert needs, which keeps the structural writes per commit O(1) amortized.
+    // The height of the side we come up from is already known, so each level only resolves the
+    // other child and its own height. Node copies move nodes but keep the parent links right,
+    // so the walk follows them instead of remembering the path on the way down.
+    NodeRef child = leaf;
+    int childHeight = 1;
+    node = arena[leaf].parent;
+    while (node != NULL_NODE) {
+        bool fromLeft = commitCounter < arena[node].commitCounter;
+        int siblingHeight = getHeight(arena, fromLeft ? getRight(arena, node, version) : getLeft(arena, node, version), version);
+        int balance = fromLeft ? childHeight - siblingHeight : siblingHeight - childHeight;
+
+        if (balance > 1) {
+            // left right
+            if (commitCounter >= arena[child].commitCounter)
+                node = arena[leftRotate(tree, child, version)].parent;
+            rightRotate(tree, node, version);
+            break;
+        }
+        if (balance < -1) {
+            // right left
+            if (commitCounter < arena[child].commitCounter)
+                node = arena[rightRotate(tree, child, version)].parent;
+            leftRotate(tree, node, version);
+            break;
+        }
+
+        int newHeight = 1 + std::max(childHeight, siblingHeight);
+        if (newHeight == getHeight(arena, node, version)) break;
+        child = updateHeight(tree, node, version, newHeight);
+        childHeight = newHeight;
+        node = arena[child].parent;
+    }
+}
+
+
+// Inserts a commit as a new version of the tree. Versions count updates (inserts, deletes, truncations),
+// not commit numbers, so a commit number freed by a rollback can be reused.
+void insertNode(CommitTree& tree, int commitCounter, const std::wstring& fileName,
+    const std::wstring& diffData, const std::wstring& commitMessage = L"") {
+    int version = tree.headVersion() + 1;
+    beginUpdate(tree, version);
+    tree.stats.commits++;
+    thawFrozen(tree, commitCounter, version);
+    attachCommit(tree, commitCounter, tree.payloads.add(fileName, diffData, commitMessage), version);
+    publishVersion(tree, version);
+}
+
+
+// The newest commit below a subtree root in the given version, the end of its right spine
+NodeRef newestNode(const CommitArena& arena, NodeRef ref, int version) {
+    if (ref == NULL_NODE) return NULL_NODE;
+    while (getRight(arena, ref, version) != NULL_NODE)
+        ref = getRight(arena, ref, version);
+    return ref;
 }
 
 
-std::shared_ptr<CommitNode> getSuccessor(const std::shared_ptr<CommitNode>& root, int commitNumber, int version) {
-    std::shared_ptr<CommitNode> successor = nullptr;
-    auto current = root;
-    while (current) {
-        if (commitNumber < current->commitCounter) {
-            successor = current;
-            current = getLeft(current, version);
+// Finds a commit in the version being written, NULL_NODE if it is not there
+NodeRef findNewest(const CommitTree& tree, int commitCounter, int version) {
+    const CommitArena& arena = tree.nodes;
+    NodeRef current = tree.root;
+    while (current != NULL_NODE && arena[current].commitCounter != commitCounter) {
+        current = (commitCounter < arena[current].commitCounter)
+            ? getLeft(arena, current, version)
+            : getRight(arena, current, version);
+    }
+    return current;
+}
+
+
+// Walks from node up to the root after a subtree below it changed height, fixing heights and rebalancing.
+// Unlike after an insert, a removal or a join can need a rotation on every level, so this always runs to the root.
+void retraceToRoot(CommitTree& tree, NodeRef node, int version) {
+    CommitArena& arena = tree.nodes;
+    while (node != NULL_NODE) {
+        NodeRef left = getLeft(arena, node, version);
+        NodeRef right = getRight(arena, node, version);
+        int leftHeight = getHeight(arena, left, version);
+        int rightHeight = getHeight(arena, right, version);
+
+        if (leftHeight - rightHeight > 1) {
+            // left right
+            if (getHeight(arena, getLeft(arena, left, version), version) < getHeight(arena, getRight(arena, left, version), version))
+                node = arena[leftRotate(tree, left, version)].parent;
+            node = rightRotate(tree, node, version);
+        }
+        else if (rightHeight - leftHeight > 1) {
+            // right left
+            if (getHeight(arena, getRight(arena, right, version), version) < getHeight(arena, getLeft(arena, right, version), version))
+                node = arena[rightRotate(tree, right, version)].parent;
+            node = leftRotate(tree, node, version);
         }
         else {
-            current = getRight(current, version);
+            int newHeight = 1 + std::max(leftHeight, rightHeight);
+            if (newHeight != getHeight(arena, node, version)) node = updateHeight(tree, node, version, newHeight);
         }
+        node = arena[node].parent;
     }
-    return successor;
 }
 
 
-std::shared_ptr<CommitNode> getPredecessor(const std::shared_ptr<CommitNode>& root, int commitNumber, int version) {
-    std::shared_ptr<CommitNode> predecessor = nullptr;
-    auto current = root;
-    while (current) {
-        if (commitNumber > current->commitCounter) {
-            predecessor = current;
-            current = getRight(current, version);
+// Unlinks a commit from the version being written. The node stays in the arena since older versions
+// still reach it. Returns false if the commit is not in the tree.
+bool removeCommit(CommitTree& tree, int commitCounter, int version) {
+    CommitArena& arena = tree.nodes;
+    NodeRef node = findNewest(tree, commitCounter, version);
+    if (node == NULL_NODE) return false;
+    tree.stats.deletions++;
+
+    // Every node the commit sits left of loses one commit on its left. Copies made here only go up,
+    // so the node itself keeps its handle.
+    for (NodeRef current = tree.root; current != node; ) {
+        if (commitCounter < arena[current].commitCounter) {
+            current = updateLeftSize(tree, current, version, getLeftSize(arena, current, version) - 1);
+            current = getLeft(arena, current, version);
         }
         else {
-            current = getLeft(current, version);
+            current = getRight(arena, current, version);
         }
     }
-    return predecessor;
-}
\ No newline at end of file
+
+    NodeRef left = getLeft(arena, node, version);
+    NodeRef right = getRight(arena, node, version);
+    NodeRef retraceFrom;
+
+    if (left == NULL_NODE || right == NULL_NODE) {
+        // At most one child, which moves up into the node's place
+        NodeRef child = (left != NULL_NODE) ? left : right;
+        NodeRef parent = arena[node].parent;
+        if (parent == NULL_NODE) {
+            tree.root = child;
+            if (child != NULL_NODE) arena[child].parent = NULL_NODE;
+            retraceFrom = NULL_NODE;
+        }
+        else if (getLeft(arena, parent, version) == node) {
+            retraceFrom = updateLeft(tree, parent, child, version);
+        }
+        else {
+            retraceFrom = updateRight(tree, parent, child, version);
+        }
+    }
+    else {
+        // Two children: the next commit in order (leftmost in the right subtree) takes the node's place
+        NodeRef next = right;
+        while (getLeft(arena, next, version) != NULL_NODE) next = getLeft(arena, next, version);
+
+        if (next == right) {
+            arena[next].parent = NULL_NODE;   // detached, so a copy is not linked back under the node
+            next = updateLeft(tree, next, left, version);
+            next = updateLeftSize(tree, next, version, getLeftSize(arena, node, version));
+            retraceFrom = next;
+        }
+        else {
+            // next leaves the left subtrees of everything between it and the right child
+            for (NodeRef current = right; current != next; current = getLeft(arena, current, version))
+                current = updateLeftSize(tree, current, version, getLeftSize(arena, current, version) - 1);
+            retraceFrom = updateLeft(tree, arena[next].parent, getRight(arena, next, version), version);
+
+            // Unlinking may have copied every node up to (and past) the removed one, so look it up again
+            node = findNewest(tree, commitCounter, version);
+            left = getLeft(arena, node, version);
+            right = getRight(arena, node, version);
+            // Right first: next still points at the child it just handed to its parent, and a copy
+            // made while that is the case would claim the child back
+            arena[next].parent = NULL_NODE;
+            next = updateRight(tree, next, right, version);
+            next = updateLeft(tree, next, left, version);
+            next = updateLeftSize(tree, next, version, getLeftSize(arena, node, version));
+        }
+
+        NodeRef parent = arena[node].parent;
+        bool wasLeft = parent != NULL_NODE && getLeft(arena, parent, version) == node;
+        replaceSubtree(tree, parent, wasLeft, next, version);
+    }
+
+    retraceToRoot(tree, retraceFrom, version);
+    return true;
+}
+
+
+// Removes a commit as a new version of the tree, in O(log n). Returns false (and adds no version)
+// if the commit is not in the newest version.
+bool deleteNode(CommitTree& tree, int commitCounter) {
+    int version = tree.headVersion() + 1;
+    beginUpdate(tree, version);
+    if (!removeCommit(tree, commitCounter, version)) return false;
+    thawFrozen(tree, commitCounter, version);
+    tree.rightmost = newestNode(tree.nodes, tree.root, version);
+    publishVersion(tree, version);
+    return true;
+}
+
+
+// Removes every commit newer than lastKept, all in one new version, which is what a rollback needs.
+// The newest commit never has a right child, so each removal is a short O(log n) unlink and retrace.
+// Returns the number of commits removed.
+int truncateCommits(CommitTree& tree, int lastKept) {
+    int version = tree.headVersion() + 1;
+    beginUpdate(tree, version);
+    CommitArena& arena = tree.nodes;
+    int removed = 0;
+    while (tree.root != NULL_NODE) {
+        NodeRef newest = newestNode(arena, tree.root, version);
+        if (arena[newest].commitCounter <= lastKept) break;
+        removeCommit(tree, arena[newest].commitCounter, version);
+        removed++;
+    }
+    if (removed > 0) {
+        thawFrozen(tree, lastKept + 1, version);
+        tree.rightmost = newestNode(arena, tree.root, version);
+        publishVersion(tree, version);
+    }
+    return removed;
+}
+
+
+// Builds the perfectly balanced subtree over commits[lo, hi) and returns its root
+NodeRef buildSubtree(CommitTree& tree, const std::vector<CommitInfo>& commits, size_t lo, size_t hi,
+    NodeRef parent, int version) {
+    if (lo >= hi) return NULL_NODE;
+    size_t mid = lo + (hi - lo) / 2;
+    const CommitInfo& commit = commits[mid];
+    NodeRef ref = tree.nodes.allocate(commit.commitNumber,
+        tree.payloads.add(commit.fileName, commit.diffData, commit.commitMessage));
+    NodeRef left = buildSubtree(tree, commits, lo, mid, ref, version);
+    NodeRef right = buildSubtree(tree, commits, mid + 1, hi, ref, version);
+
+    CommitNode& node = tree.nodes[ref];
+    node.version = version;
+    node.parent = parent;
+    node.left = left;
+    node.right = right;
+    node.height = 1 + std::max(getHeight(tree.nodes, left, version), getHeight(tree.nodes, right, version));
+    node.leftSize = (int)(mid - lo);
+    cacheOriginals(node);
+    return ref;
+}
+
+
+// Replaces the tree with a perfectly balanced one holding the given commits, which must be sorted by
+// commit number, in O(n). The whole run becomes version 1. Later commits are inserted as usual.
+void buildCommitTree(CommitTree& tree, const std::vector<CommitInfo>& commits) {
+    tree.clear();
+    if (commits.empty()) return;
+    int version = 1;
+    tree.root = buildSubtree(tree, commits, 0, commits.size(), NULL_NODE, version);
+    tree.rightmost = newestNode(tree.nodes, tree.root, version);
+    publishVersion(tree, version);
+    tree.stats.commits += commits.size();
+}
+
+
+// Inserts a run of commits, sorted by commit number, as one new version of the tree. A run newer than
+// every commit in the tree (an import, several files committed together) is built as a balanced subtree
+// and joined to the tree in one pass, O(b + log n) with a single retrace from the join point. A run that
+// interleaves with the tree goes in commit by commit, but under one version, so a node copied for one
+// commit is updated in place for the next ones instead of being copied again.
+void insertCommits(CommitTree& tree, const std::vector<CommitInfo>& commits) {
+    if (commits.empty()) return;
+    int version = tree.headVersion() + 1;
+    beginUpdate(tree, version);
+    CommitArena& arena = tree.nodes;
+    tree.stats.commits += commits.size();
+    thawFrozen(tree, commits.front().commitNumber, version);
+
+    if (tree.root != NULL_NODE && commits.front().commitNumber <= arena[tree.rightmost].commitCounter) {
+        for (const CommitInfo& commit : commits)
+            attachCommit(tree, commit.commitNumber, tree.payloads.add(commit.fileName, commit.diffData, commit.commitMessage), version);
+        publishVersion(tree, version);
+        return;
+    }
+
+    // The first commit of the run becomes the joint between the tree on its left and the rest of the run
+    const CommitInfo& first = commits.front();
+    NodeRef joint = arena.allocate(first.commitNumber, tree.payloads.add(first.fileName, first.diffData, first.commitMessage));
+    NodeRef batch = buildSubtree(tree, commits, 1, commits.size(), NULL_NODE, version);
+    int batchHeight = getHeight(arena, batch, version);
+
+    // Go down the right spine of the tree to a subtree no more than one level taller than the run
+    NodeRef parent = NULL_NODE;
+    NodeRef left = tree.root;
+    while (getHeight(arena, left, version) > batchHeight + 1) {
+        parent = left;
+        left = getRight(arena, left, version);
+    }
+    int leftHeight = getHeight(arena, left, version);
+    int leftCount = 0;
+    for (NodeRef spine = left; spine != NULL_NODE; spine = getRight(arena, spine, version))
+        leftCount += getLeftSize(arena, spine, version) + 1;
+
+    // or, when the run is the taller one, down its left spine. Those nodes were just built and
+    // gain the joint and everything left of it.
+    NodeRef batchParent = NULL_NODE;
+    NodeRef right = batch;
+    while (getHeight(arena, right, version) > leftHeight + 1) {
+        batchParent = right;
+        right = updateLeftSize(tree, right, version, getLeftSize(arena, right, version) + leftCount + 1);
+        right = getLeft(arena, right, version);
+    }
+
+    CommitNode& node = arena[joint];
+    node.version = version;
+    node.left = left;
+    node.right = right;
+    node.height = 1 + std::max(leftHeight, getHeight(arena, right, version));
+    node.leftSize = leftCount;
+    cacheOriginals(node);
+    if (left != NULL_NODE) arena[left].parent = joint;
+    if (right != NULL_NODE) arena[right].parent = joint;
+
+    NodeRef top = joint;
+    if (batchParent != NULL_NODE) {
+        updateLeft(tree, batchParent, joint, version);
+        top = batch;
+    }
+    replaceSubtree(tree, parent, false, top, version);
+    retraceToRoot(tree, arena[joint].parent, version);
+
+    tree.rightmost = newestNode(arena, tree.root, version);
+    publishVersion(tree, version);
+}
+
+
+// Looks up the file name, diff summary and message of a commit node
+CommitInfo getCommitInfo(const CommitTree& tree, const CommitNode& node) {
+    const CommitPayload& payload = tree.payloads.payloads[node.payload];
+    return { node.commitCounter, tree.payloads.strings.get(payload.fileName),
+        tree.payloads.strings.get(payload.diffData), tree.payloads.strings.get(payload.commitMessage) };
+}
+
+
+// Returns the root a query for the given version starts from. Versions past the newest one see the newest tree.
+NodeRef rootForVersion(const CommitTree& tree, int version) {
+    if (version < 0) return NULL_NODE;
+    return tree.versionRoots[std::min(version, tree.headVersion())];
+}
+
+
+// Last commit number a history has bits for
+int frozenEnd(const FrozenHistory& history) {
+    return history.first - 1 + (int)(history.present.size() * 64);
+}
+
+
+// Number of frozen commits <= commitNumber, which must not be past the history's end. O(1)
+int frozenRank(const FrozenHistory& history, int commitNumber) {
+    if (commitNumber < history.first) return 0;
+    uint32_t bit = (uint32_t)(commitNumber - history.first);
+    uint64_t upTo = history.present[bit >> 6] & ((2ull << (bit & 63)) - 1);
+    return (int)(history.presentBefore[bit >> 6] + std::bitset<64>(upTo).count());
+}
+
+
+bool frozenContains(const FrozenHistory& history, int commitNumber) {
+    if (commitNumber < history.first) return false;
+    uint32_t bit = (uint32_t)(commitNumber - history.first);
+    return (history.present[bit >> 6] >> (bit & 63)) & 1;
+}
+
+
+// Takes a handle on the given version; every query through it sees exactly that version. O(log v) in
+// the number of frozen views, which only grows with freezes and edits of frozen history.
+CommitSnapshot snapshot(const CommitTree& tree, int version) {
+    CommitSnapshot snap;
+    snap.tree = &tree;
+    snap.root = rootForVersion(tree, version);
+    snap.version = std::min(version, tree.headVersion());   // a version not published yet may be mid-write
+    snap.frozen = nullptr;
+    snap.frozenThrough = INT_MIN;
+
+    // The last view that started at or before the version
+    uint32_t lo = 0, hi = tree.frozenViews.size();
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tree.frozenViews[mid].version <= snap.version) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0) {
+        const FrozenView& view = tree.frozenViews[lo - 1];
+        snap.frozen = view.history;
+        snap.frozenThrough = view.through;
+    }
+    return snap;
+}
+
+
+const CommitNode* searchCommit(const CommitSnapshot& snap, int targetCommit) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && targetCommit <= snap.frozenThrough) {
+        const FrozenHistory& frozen = *snap.frozen;
+        if (!frozenContains(frozen, targetCommit)) return nullptr;
+        return &arena[frozen.commits[frozenRank(frozen, targetCommit) - 1]];
+    }
+    NodeRef current = snap.root;
+    while (current != NULL_NODE) {
+        const CommitNode& node = arena[current];
+        if (targetCommit == node.commitCounter)
+            return &node;
+        else if (targetCommit < node.commitCounter)
+            current = getLeft(arena, current, snap.version);
+        else
+            current = getRight(arena, current, snap.version);
+    }
+    return nullptr;
+}
+
+
+const CommitNode* getSuccessor(const CommitSnapshot& snap, int commitNumber) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && commitNumber < snap.frozenThrough) {
+        // The successor is the frozen commit right after the ones <= commitNumber, if any is left
+        const FrozenHistory& frozen = *snap.frozen;
+        int rank = frozenRank(frozen, commitNumber);
+        if (rank < frozenRank(frozen, snap.frozenThrough)) return &arena[frozen.commits[rank]];
+        commitNumber = snap.frozenThrough;
+    }
+    const CommitNode* successor = nullptr;
+    NodeRef current = snap.root;
+    while (current != NULL_NODE) {
+        const CommitNode& node = arena[current];
+        if (commitNumber < node.commitCounter) {
+            successor = &node;
+            current = getLeft(arena, current, snap.version);
+        }
+        else {
+            current = getRight(arena, current, snap.version);
+        }
+    }
+    return successor;
+}
+
+
+const CommitNode* getPredecessor(const CommitSnapshot& snap, int commitNumber) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && commitNumber <= snap.frozenThrough) {
+        const FrozenHistory& frozen = *snap.frozen;
+        int rank = (commitNumber > frozen.first) ? frozenRank(frozen, commitNumber - 1) : 0;
+        return (rank > 0) ? &arena[frozen.commits[rank - 1]] : nullptr;
+    }
+    const CommitNode* predecessor = nullptr;
+    NodeRef current = snap.root;
+    while (current != NULL_NODE) {
+        const CommitNode& node = arena[current];
+        if (commitNumber > node.commitCounter) {
+            predecessor = &node;
+            current = getRight(arena, current, snap.version);
+        }
+        else {
+            current = getLeft(arena, current, snap.version);
+        }
+    }
+    return predecessor;
+}
+
+
+// Oldest commit in the snapshot, iterate forward from it with getSuccessor
+const CommitNode* firstCommit(const CommitSnapshot& snap) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && frozenRank(*snap.frozen, snap.frozenThrough) > 0)
+        return &arena[snap.frozen->commits[0]];
+    NodeRef current = snap.root;
+    if (current == NULL_NODE) return nullptr;
+    while (getLeft(arena, current, snap.version) != NULL_NODE)
+        current = getLeft(arena, current, snap.version);
+    return &arena[current];
+}
+
+
+// Newest commit in the snapshot, iterate backward from it with getPredecessor
+const CommitNode* lastCommit(const CommitSnapshot& snap) {
+    const CommitArena& arena = snap.tree->nodes;
+    NodeRef current = snap.root;
+    if (current == NULL_NODE) return nullptr;
+    while (getRight(arena, current, snap.version) != NULL_NODE)
+        current = getRight(arena, current, snap.version);
+    return &arena[current];
+}
+
+
+// The k-th oldest commit (1-based) in the snapshot, or nullptr when k is out of range. O(log n)
+const CommitNode* selectCommit(const CommitSnapshot& snap, int k) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && k >= 1 && k <= frozenRank(*snap.frozen, snap.frozenThrough))
+        return &arena[snap.frozen->commits[k - 1]];
+    NodeRef current = snap.root;
+    while (current != NULL_NODE) {
+        int leftSize = getLeftSize(arena, current, snap.version);
+        if (k <= leftSize) {
+            current = getLeft(arena, current, snap.version);
+        }
+        else if (k == leftSize + 1) {
+            return &arena[current];
+        }
+        else {
+            k -= leftSize + 1;
+            current = getRight(arena, current, snap.version);
+        }
+    }
+    return nullptr;
+}
+
+
+// Number of commits in the snapshot with a commit number <= the given one, which is the
+// 1-based position of that commit when it exists. O(log n)
+int rankCommit(const CommitSnapshot& snap, int commitNumber) {
+    const CommitArena& arena = snap.tree->nodes;
+    if (snap.frozen != nullptr && commitNumber <= snap.frozenThrough)
+        return frozenRank(*snap.frozen, commitNumber);
+    int rank = 0;
+    NodeRef current = snap.root;
+    while (current != NULL_NODE) {
+        if (commitNumber < arena[current].commitCounter) {
+            current = getLeft(arena, current, snap.version);
+        }
+        else {
+            rank += getLeftSize(arena, current, snap.version) + 1;
+            current = getRight(arena, current, snap.version);
+        }
+    }
+    return rank;
+}
+
+
+// Number of commits in the snapshot, summed down the right spine. O(log n)
+int commitCount(const CommitSnapshot& snap) {
+    const CommitArena& arena = snap.tree->nodes;
+    int count = 0;
+    for (NodeRef current = snap.root; current != NULL_NODE; current = getRight(arena, current, snap.version))
+        count += getLeftSize(arena, current, snap.version) + 1;
+    return count;
+}
+
+
+// In-order iterator over the commits of one version, optionally bounded to [lo, hi]. The path to the
+// current node lives in a fixed-size stack (an AVL tree of 2^32 nodes is at most 46 levels deep), so
+// stepping never allocates and walking N commits is O(N) after the O(log n) seek.
+struct CommitIterator {
+    static const int MAX_DEPTH = 64;
+
+    const CommitArena* arena;
+    int version;
+    int hi;
+    NodeRef stack[MAX_DEPTH];
+    int depth;
+
+    bool valid() const { return depth > 0 && (*arena)[stack[depth - 1]].commitCounter <= hi; }
+
+    const CommitNode& current() const { return (*arena)[stack[depth - 1]]; }
+
+    NodeRef currentRef() const { return stack[depth - 1]; }
+
+    // Pushes node and its chain of left children
+    void pushLeftSpine(NodeRef node) {
+        while (node != NULL_NODE) {
+            stack[depth++] = node;
+            node = getLeft(*arena, node, version);
+        }
+    }
+
+    void next() {
+        NodeRef node = stack[--depth];
+        pushLeftSpine(getRight(*arena, node, version));
+    }
+};
+
+
+// Iterator positioned on the first commit >= lo of the snapshot, stopping after hi
+CommitIterator commitRange(const CommitSnapshot& snap, int lo, int hi) {
+    CommitIterator it;
+    it.arena = &snap.tree->nodes;
+    it.version = snap.version;
+    it.hi = hi;
+    it.depth = 0;
+
+    // Keep the ancestors we leave to the left of, they are the commits that follow lo in order
+    NodeRef node = snap.root;
+    while (node != NULL_NODE) {
+        if ((*it.arena)[node].commitCounter >= lo) {
+            it.stack[it.depth++] = node;
+            node = getLeft(*it.arena, node, it.version);
+        }
+        else {
+            node = getRight(*it.arena, node, it.version);
+        }
+    }
+    return it;
+}
+
+
+// Iterator over every commit of the snapshot, oldest first
+CommitIterator commitBegin(const CommitSnapshot& snap) {
+    return commitRange(snap, INT_MIN, INT_MAX);
+}
+
+
+const CommitNode* selectCommit(const CommitTree& tree, int k, int version) {
+    return selectCommit(snapshot(tree, version), k);
+}
+
+
+int rankCommit(const CommitTree& tree, int commitNumber, int version) {
+    return rankCommit(snapshot(tree, version), commitNumber);
+}
+
+
+const CommitNode* searchCommit(const CommitTree& tree, int targetCommit, int version) {
+    return searchCommit(snapshot(tree, version), targetCommit);
+}
+
+
+const CommitNode* getSuccessor(const CommitTree& tree, int commitNumber, int version) {
+    return getSuccessor(snapshot(tree, version), commitNumber);
+}
+
+
+const CommitNode* getPredecessor(const CommitTree& tree, int commitNumber, int version) {
+    return getPredecessor(snapshot(tree, version), commitNumber);
+}
+
+
+// Takes a handle on a version of any branch. Branch snapshots never use frozen history, which only
+// describes the main line.
+CommitSnapshot snapshot(const CommitTree& tree, CommitVersion version) {
+    if (version.branch == 0) return snapshot(tree, version.version);
+    const CommitBranch& branch = tree.branches[version.branch];
+    CommitSnapshot snap;
+    snap.tree = &tree;
+    snap.root = branch.roots[std::min(version.version, (int)branch.roots.size() - 1)];
+    snap.version = branch.base;
+    snap.frozen = nullptr;
+    snap.frozenThrough = INT_MIN;
+    return snap;
+}
+
+
+int branchHeadVersion(const CommitTree& tree, int branch) {
+    return (branch == 0) ? tree.headVersion() : (int)tree.branches[branch].roots.size() - 1;
+}
+
+
+// The version a version was made from, which is the previous version of its branch or, for the first
+// version of a branch, the version the branch forked from. Returns false for the empty main line version 0.
+bool parentVersion(const CommitTree& tree, CommitVersion version, CommitVersion& parent) {
+    if (version.version > 0) {
+        parent.branch = version.branch;
+        parent.version = version.version - 1;
+        return true;
+    }
+    if (version.branch == 0) return false;
+    parent = tree.branches[version.branch].forkedFrom;
+    return true;
+}
+
+
+// Starts a branch at a version of the main line or of another branch, in O(1): until it changes
+// something, the branch shares every node with that version. Returns the new branch's number.
+int forkBranch(CommitTree& tree, CommitVersion from) {
+    NodeRef root;
+    int base;
+    if (from.branch == 0) {
+        base = std::min(from.version, tree.headVersion());
+        root = rootForVersion(tree, base);
+    }
+    else {
+        const CommitBranch& parent = tree.branches[from.branch];
+        base = parent.base;
+        root = parent.roots[std::min(from.version, (int)parent.roots.size() - 1)];
+    }
+
+    int index = (int)tree.branches.append();
+    CommitBranch& branch = tree.branches[index];
+    branch.forkedFrom = from;
+    branch.base = base;
+    branch.roots.push_back(root);
+    return index;
+}
+
+
+// A node of a branch version, made with its final fields. Only its commit is taken from like.
+NodeRef branchNode(CommitTree& tree, NodeRef like, NodeRef left, int leftSize, NodeRef right, int base) {
+    CommitArena& arena = tree.nodes;
+    NodeRef ref = arena.allocate(arena[like].commitCounter, arena[like].payload);
+    CommitNode& node = arena[ref];
+    node.version = base;
+    node.left = left;
+    node.right = right;
+    node.height = 1 + std::max(getHeight(arena, left, base), getHeight(arena, right, base));
+    node.leftSize = leftSize;
+    cacheOriginals(node);
+    return ref;
+}
+
+
+// Branch node for top's commit over two subtrees whose heights differ by at most two, rotated back into
+// AVL shape when they differ by two. leftSize is the number of commits in left.
+NodeRef balanceBranch(CommitTree& tree, NodeRef top, NodeRef left, int leftSize, NodeRef right, int base) {
+    const CommitArena& arena = tree.nodes;
+    int leftHeight = getHeight(arena, left, base);
+    int rightHeight = getHeight(arena, right, base);
+
+    if (leftHeight - rightHeight > 1) {
+        NodeRef outer = getLeft(arena, left, base);
+        NodeRef inner = getRight(arena, left, base);
+        int outerSize = getLeftSize(arena, left, base);
+        if (getHeight(arena, outer, base) >= getHeight(arena, inner, base)) {
+            // left left
+            NodeRef lowered = branchNode(tree, top, inner, leftSize - outerSize - 1, right, base);
+            return branchNode(tree, left, outer, outerSize, lowered, base);
+        }
+        // left right
+        int innerSize = getLeftSize(arena, inner, base);
+        NodeRef newLeft = branchNode(tree, left, outer, outerSize, getLeft(arena, inner, base), base);
+        NodeRef newRight = branchNode(tree, top, getRight(arena, inner, base), leftSize - outerSize - innerSize - 2, right, base);
+        return branchNode(tree, inner, newLeft, outerSize + 1 + innerSize, newRight, base);
+    }
+    if (rightHeight - leftHeight > 1) {
+        NodeRef inner = getLeft(arena, right, base);
+        NodeRef outer = getRight(arena, right, base);
+        int innerSize = getLeftSize(arena, right, base);
+        if (getHeight(arena, outer, base) >= getHeight(arena, inner, base)) {
+            // right right
+            NodeRef lowered = branchNode(tree, top, left, leftSize, inner, base);
+            return branchNode(tree, right, lowered, leftSize + 1 + innerSize, outer, base);
+        }
+        // right left
+        int innerLeftSize = getLeftSize(arena, inner, base);
+        NodeRef newLeft = branchNode(tree, top, left, leftSize, getLeft(arena, inner, base), base);
+        NodeRef newRight = branchNode(tree, right, getRight(arena, inner, base), innerSize - innerLeftSize - 1, outer, base);
+        return branchNode(tree, inner, newLeft, leftSize + 1 + innerLeftSize, newRight, base);
+    }
+    return branchNode(tree, top, left, leftSize, right, base);
+}
+
+
+// Path copying insert: returns the root of a new subtree holding leaf as well, copying only the path down to it
+NodeRef branchInsert(CommitTree& tree, NodeRef node, NodeRef leaf, int base) {
+    const CommitArena& arena = tree.nodes;
+    if (node == NULL_NODE) return leaf;
+    NodeRef left = getLeft(arena, node, base);
+    NodeRef right = getRight(arena, node, base);
+    int leftSize = getLeftSize(arena, node, base);
+    if (arena[leaf].commitCounter < arena[node].commitCounter)
+        return balanceBranch(tree, node, branchInsert(tree, left, leaf, base), leftSize + 1, right, base);
+    return balanceBranch(tree, node, left, leftSize, branchInsert(tree, right, leaf, base), base);
+}
+
+
+// Path copying removal of the oldest commit below node, which is handed back in first
+NodeRef branchRemoveFirst(CommitTree& tree, NodeRef node, NodeRef& first, int base) {
+    const CommitArena& arena = tree.nodes;
+    NodeRef left = getLeft(arena, node, base);
+    if (left == NULL_NODE) {
+        first = node;
+        return getRight(arena, node, base);
+    }
+    NodeRef rest = branchRemoveFirst(tree, left, first, base);
+    return balanceBranch(tree, node, rest, getLeftSize(arena, node, base) - 1, getRight(arena, node, base), base);
+}
+
+
+// Path copying removal, the subtree is handed back unchanged when the commit is not in it
+NodeRef branchRemove(CommitTree& tree, NodeRef node, int commitCounter, int base, bool& removed) {
+    const CommitArena& arena = tree.nodes;
+    if (node == NULL_NODE) return NULL_NODE;
+    NodeRef left = getLeft(arena, node, base);
+    NodeRef right = getRight(arena, node, base);
+    int leftSize = getLeftSize(arena, node, base);
+
+    if (commitCounter < arena[node].commitCounter) {
+        NodeRef rest = branchRemove(tree, left, commitCounter, base, removed);
+        return removed ? balanceBranch(tree, node, rest, leftSize - 1, right, base) : node;
+    }
+    if (commitCounter > arena[node].commitCounter) {
+        NodeRef rest = branchRemove(tree, right, commitCounter, base, removed);
+        return removed ? balanceBranch(tree, node, left, leftSize, rest, base) : node;
+    }
+
+    removed = true;
+    if (left == NULL_NODE) return right;
+    if (right == NULL_NODE) return left;
+    NodeRef next;
+    NodeRef rest = branchRemoveFirst(tree, right, next, base);
+    return balanceBranch(tree, next, left, leftSize, rest, base);
+}
+
+
+// Adds a commit as a new version of a branch. On a branch this copies the O(log n) nodes on the path
+// to the commit, so a branch costs memory for what it changes, not for the history it shares; the
+// main line and every other branch keep seeing what they saw.
+void insertBranchCommit(CommitTree& tree, int branch, int commitCounter, const std::wstring& fileName,
+    const std::wstring& diffData, const std::wstring& commitMessage = L"") {
+    if (branch == 0) {
+        insertNode(tree, commitCounter, fileName, diffData, commitMessage);
+        return;
+    }
+    CommitBranch& line = tree.branches[branch];
+    NodeRef leaf = tree.nodes.allocate(commitCounter, tree.payloads.add(fileName, diffData, commitMessage));
+    tree.nodes[leaf].version = line.base;
+    cacheOriginals(tree.nodes[leaf]);
+    tree.stats.commits++;
+    line.roots.push_back(branchInsert(tree, line.roots[line.roots.size() - 1], leaf, line.base));
+}
+
+
+// Removes a commit as a new version of a branch. Returns false (and adds no version) if the commit
+// is not in the branch's newest version.
+bool deleteBranchCommit(CommitTree& tree, int branch, int commitCounter) {
+    if (branch == 0) return deleteNode(tree, commitCounter);
+    CommitBranch& line = tree.branches[branch];
+    bool removed = false;
+    NodeRef root = branchRemove(tree, line.roots[line.roots.size() - 1], commitCounter, line.base, removed);
+    if (!removed) return false;
+    tree.stats.deletions++;
+    line.roots.push_back(root);
+    return true;
+}
+
+
+// Epoch based reclamation for trees that are replaced while reader threads may still walk them.
+// A reader announces the epoch it started in, and a retired tree is only freed once every reader
+// that was active when it was retired has left.
+struct CommitEpochs {
+    static const int MAX_READERS = 64;
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<uint64_t> readers[MAX_READERS];   // epoch each reader slot entered in, 0 when free
+
+    CommitEpochs() : epoch(1) {
+        for (int slot = 0; slot < MAX_READERS; slot++) readers[slot].store(0);
+    }
+
+    // Claims a reader slot, waiting for one to free up when all are taken
+    int enter() {
+        for (;;) {
+            for (int slot = 0; slot < MAX_READERS; slot++) {
+                uint64_t unused = 0;
+                if (readers[slot].compare_exchange_strong(unused, epoch.load()))
+                    return slot;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void leave(int slot) { readers[slot].store(0, std::memory_order_release); }
+
+    // True once no reader that entered at or before the given epoch is still active
+    bool quiescent(uint64_t retiredEpoch) const {
+        for (int slot = 0; slot < MAX_READERS; slot++) {
+            uint64_t entered = readers[slot].load();
+            if (entered != 0 && entered <= retiredEpoch) return false;
+        }
+        return true;
+    }
+};
+
+
+// The commit tree as seen by reader threads (search, diff, prefetch workers). The writer keeps
+// committing into the current tree, which is safe because published versions are never changed.
+// Replacing the whole tree (repository switch, rebuild) retires the old one until the readers that
+// could still see it are gone. Only the writer thread calls the non-const members.
+struct CommitTreePublisher {
+    std::atomic<CommitTree*> current;
+    CommitEpochs epochs;
+    std::vector<std::pair<uint64_t, CommitTree*>> retired;   // epoch it was retired in, tree
+
+    CommitTreePublisher() : current(new CommitTree) {}
+    CommitTreePublisher(const CommitTreePublisher&) = delete;
+    CommitTreePublisher& operator=(const CommitTreePublisher&) = delete;
+
+    // No reader may be active when the publisher goes away
+    ~CommitTreePublisher() {
+        for (auto& entry : retired) delete entry.second;
+        delete current.load();
+    }
+
+    // The writer's tree, commits go straight into it
+    CommitTree& writable() { return *current.load(std::memory_order_relaxed); }
+};
+
+
+// Frees the retired trees no reader can reach anymore. Returns how many are still pinned.
+size_t reclaimCommitTrees(CommitTreePublisher& publisher) {
+    auto& retired = publisher.retired;
+    auto pinned = std::partition(retired.begin(), retired.end(),
+        [&](const std::pair<uint64_t, CommitTree*>& entry) { return !publisher.epochs.quiescent(entry.first); });
+    for (auto it = pinned; it != retired.end(); ++it) delete it->second;
+    retired.erase(pinned, retired.end());
+    return retired.size();
+}
+
+
+// Swaps in a freshly built tree (taking ownership of it) and retires the previous one
+void publishCommitTree(CommitTreePublisher& publisher, CommitTree* tree) {
+    CommitTree* old = publisher.current.exchange(tree);
+    publisher.retired.emplace_back(publisher.epochs.epoch.fetch_add(1), old);
+    reclaimCommitTrees(publisher);
+}
+
+
+// Read side critical section for a background thread. While the guard lives, the tree it pinned and
+// every snapshot taken from it stay valid, without either side taking a lock. Keep guards short, a
+// long-lived one delays freeing replaced trees.
+struct CommitReadGuard {
+    CommitTreePublisher& publisher;
+    int slot;
+    const CommitTree* tree;
+
+    explicit CommitReadGuard(CommitTreePublisher& pub)
+        : publisher(pub), slot(pub.epochs.enter()), tree(pub.current.load()) {
+    }
+    ~CommitReadGuard() { publisher.epochs.leave(slot); }
+    CommitReadGuard(const CommitReadGuard&) = delete;
+    CommitReadGuard& operator=(const CommitReadGuard&) = delete;
+
+    // The newest version published so far, it stays the same no matter what the writer does next
+    CommitSnapshot head() const { return snapshot(*tree, tree->headVersion()); }
+};
+
+
+// Commits kept in the tree above the frozen range. A freeze starts once twice this many have piled up,
+// so each freeze copies O(tail) commits and the frozen range trails the newest commit by at most 2 * tail.
+#ifndef COMMIT_TREE_FROZEN_TAIL
+#define COMMIT_TREE_FROZEN_TAIL 1024
+#endif
+
+
+// Background freeze stage. A worker thread copies the commits that have fallen far enough behind the
+// newest one from a published version into a FrozenHistory, without blocking the writer; the writer
+// then makes the history visible with a new FrozenView. Only the writer thread touches the freezer.
+struct CommitFreezer {
+    std::thread worker;
+    std::atomic<bool> finished;
+    uint64_t epoch;                         // publisher epoch of the tree being frozen
+    FrozenHistory* history;                 // the worker appends to it
+    std::unique_ptr<FrozenHistory> fresh;   // set when history is a new one, handed to the tree on install
+    int version;                            // version the commits are copied from
+    int through;
+
+    CommitFreezer() : finished(false), epoch(0), history(nullptr), version(0), through(0) {}
+    CommitFreezer(const CommitFreezer&) = delete;
+    CommitFreezer& operator=(const CommitFreezer&) = delete;
+
+    // The publisher must outlive the freezer, the worker reads its tree
+    ~CommitFreezer() {
+        if (worker.joinable()) worker.join();
+    }
+};
+
+
+// Worker thread body: appends the commits in (end of the history, through] as whole bitmap words.
+// The guard was taken by the writer when it started the freeze and pins the tree until we are done.
+void freezeCommits(CommitFreezer* freezer, CommitReadGuard* guard) {
+    std::unique_ptr<CommitReadGuard> pin(guard);
+    FrozenHistory& history = *freezer->history;
+    uint32_t words = (uint32_t)(freezer->through - history.first + 1) >> 6;
+    uint32_t word = history.present.size();
+    uint32_t before = history.commits.size();
+    uint64_t bits = 0;
+
+    CommitSnapshot snap = snapshot(*guard->tree, freezer->version);
+    for (CommitIterator it = commitRange(snap, frozenEnd(history) + 1, freezer->through); it.valid(); it.next()) {
+        uint32_t bit = (uint32_t)(it.current().commitCounter - history.first);
+        while ((bit >> 6) > word) {
+            history.presentBefore.push_back(before);
+            history.present.push_back(bits);
+            before = history.commits.size();
+            bits = 0;
+            word++;
+        }
+        bits |= 1ull << (bit & 63);
+        history.commits.push_back(it.currentRef());
+    }
+    while (word < words) {
+        history.presentBefore.push_back(before);
+        history.present.push_back(bits);
+        before = history.commits.size();
+        bits = 0;
+        word++;
+    }
+    freezer->finished.store(true, std::memory_order_release);
+}
+
+
+// Starts a freeze when more than 2 * COMMIT_TREE_FROZEN_TAIL commits sit above the frozen range of the
+// newest version. The freeze keeps appending to the history that range comes from, unless an edit
+// has cut the range back since, in which case it starts a new history from the oldest commit.
+void startFreeze(CommitFreezer& freezer, CommitTreePublisher& publisher) {
+    CommitTree& tree = publisher.writable();
+    CommitSnapshot head = snapshot(tree, tree.headVersion());
+    int count = commitCount(head);
+    int frozen = (head.frozen != nullptr) ? frozenRank(*head.frozen, head.frozenThrough) : 0;
+    if (count - frozen < 2 * COMMIT_TREE_FROZEN_TAIL) return;
+
+    uint32_t views = tree.frozenViews.size();
+    FrozenHistory* history = (views > 0) ? tree.frozenViews[views - 1].history : nullptr;
+    if (history == nullptr || frozenEnd(*history) != head.frozenThrough) {
+        freezer.fresh.reset(new FrozenHistory);
+        freezer.fresh->first = firstCommit(head)->commitCounter;
+        history = freezer.fresh.get();
+    }
+
+    // Freeze up to the last whole bitmap word before the tail
+    int keep = selectCommit(head, count - COMMIT_TREE_FROZEN_TAIL)->commitCounter;
+    int through = history->first - 1 + (keep - history->first + 1) / 64 * 64;
+    if (through <= frozenEnd(*history)) {
+        freezer.fresh.reset();
+        return;
+    }
+
+    freezer.epoch = publisher.epochs.epoch.load();
+    freezer.history = history;
+    freezer.version = head.version;
+    freezer.through = through;
+    freezer.finished.store(false);
+    tree.lowestEdit = INT_MAX;
+    freezer.worker = std::thread(freezeCommits, &freezer, new CommitReadGuard(publisher));
+}
+
+
+// Makes a finished freeze visible from the head version on. Updates made while the worker ran may have
+// touched commits it copied, those stay with the tree. Dropped if the tree was replaced meanwhile.
+void installFreeze(CommitFreezer& freezer, CommitTreePublisher& publisher) {
+    std::unique_ptr<FrozenHistory> fresh = std::move(freezer.fresh);
+    if (publisher.epochs.epoch.load() != freezer.epoch) return;
+
+    CommitTree& tree = publisher.writable();
+    FrozenView view = { tree.headVersion(), freezer.history, std::min(freezer.through, tree.lowestEdit - 1) };
+    if (fresh) tree.frozenHistories.push_back(std::move(fresh));
+    tree.frozenViews.push_back(view);
+}
+
+
+// Writer side of the freeze stage, call after every update. Installs a finished freeze and starts
+// the next one when enough history has piled up; never waits for the worker.
+void freezeCommitHistory(CommitFreezer& freezer, CommitTreePublisher& publisher) {
+    if (freezer.worker.joinable()) {
+        if (!freezer.finished.load(std::memory_order_acquire)) return;
+        freezer.worker.join();
+        installFreeze(freezer, publisher);
+    }
+    startFreeze(freezer, publisher);
+}
+
+
+// Which versions a compaction keeps. The newest keepRecent versions all stay, older ones only survive
+// as checkpoints, every checkpointEvery-th version. A dropped version still answers queries, with what
+// the newest kept version before it held.
+struct CommitRetention {
+    int keepRecent;
+    int checkpointEvery;   // 0 keeps no checkpoints
+};
+
+
+bool retainsVersion(const CommitRetention& retention, int version, int head) {
+    if (version > head - retention.keepRecent) return true;
+    return retention.checkpointEvery > 0 && version % retention.checkpointEvery == 0;
+}
+
+
+// Bytes the tree's arrays take up. Frozen histories are left out, the freezer rebuilds them for any tree.
+size_t commitTreeBytes(const CommitTree& tree) {
+    return tree.nodes.bytesReserved() + tree.versionRoots.bytesReserved() + tree.payloads.payloads.bytesReserved()
+        + tree.payloads.strings.strings.bytesReserved() + tree.payloads.strings.chars.bytesReserved();
+}
+
+
+// What the last compaction did. The old tree is freed once no reader can reach it anymore.
+struct CompactionReport {
+    size_t bytesBefore;
+    size_t bytesAfter;
+    int versionsKept;
+    int versionsDropped;
+
+    CompactionReport() : bytesBefore(0), bytesAfter(0), versionsKept(0), versionsDropped(0) {}
+
+    size_t bytesReclaimed() const { return (bytesBefore > bytesAfter) ? bytesBefore - bytesAfter : 0; }
+};
+
+
+// A commit as it was inserted once: the versions it is in are [inserted, removed)
+struct RetainedCommit {
+    int commitCounter;
+    uint32_t payload;   // in the tree being compacted
+    int inserted;
+    int removed;        // INT_MAX while it is still in the tree
+};
+
+
+// Background compaction stage. A worker thread builds a copy of a published version that only carries
+// changes at the versions the retention keeps: node copies no kept version reaches and mods for
+// dropped versions never make it in. The copy then replaces the tree (see publishCommitTree). Versions
+// published while the worker ran are added on the writer thread once it is done, which only looks at
+// the commits they changed, so the writer never waits. A copy that should live in a file, like the tree
+// it replaces, is saved and mapped back by the worker as well.
+// Only the writer thread touches the compactor.
+struct CommitCompactor {
+    CommitRetention retention;
+    std::thread worker;
+    std::atomic<bool> finished;
+    uint64_t epoch;                        // publisher epoch of the tree being compacted
+    std::unique_ptr<CommitTree> copy;      // built by the worker, covers versions up to its head
+    std::vector<RetainedCommit> commits;   // commits in the copy's newest version
+    uint32_t nodesScanned;                 // source nodes looked at for inserts so far
+    uint32_t nodesThrough;                 // source nodes allocated up to version
+    uint32_t nextPayload;                  // source payloads below this belong to commits already seen
+    int version;                           // source version the running worker builds up to
+    int versionsKept;
+    uint64_t compactedEpoch;               // publisher epoch right after the last install
+    int compactedAt;                       // head version at the last install
+    CompactionReport report;
+    // Saves a finished copy and returns the tree mapped back from it, or null to keep the copy on the
+    // heap. Runs on the worker thread; a worker uses the one set when it was started.
+    std::function<CommitTree*(const CommitTree& copy)> save;
+
+    explicit CommitCompactor(const CommitRetention& keep)
+        : retention(keep), finished(false), epoch(0), nodesScanned(0), nodesThrough(0), nextPayload(0),
+          version(0), versionsKept(0), compactedEpoch(0), compactedAt(0) {
+    }
+    CommitCompactor(const CommitCompactor&) = delete;
+    CommitCompactor& operator=(const CommitCompactor&) = delete;
+
+    // The publisher must outlive the compactor, the worker reads its tree
+    ~CommitCompactor() {
+        if (worker.joinable()) worker.join();
+    }
+};
+
+
+// Worker thread body: brings the copy from its head up to compactor->version of the source tree.
+// A first run keeps the versions the retention asks for, a follow-up run keeps every version it adds.
+// O(n log n) for the n commits a first run puts in the copy. A follow-up run costs O(log v log n) for
+// each commit inserted or removed since the last one, plus O(log n) for each newer commit it passes on
+// the way to a removed one. A copy still on the heap is then handed to save, when there is one.
+void compactCommits(CommitCompactor* compactor, CommitReadGuard* guard, std::function<CommitTree*(const CommitTree&)> save) {
+    std::unique_ptr<CommitReadGuard> pin(guard);
+    const CommitTree& source = *guard->tree;
+    CommitTree& copy = *compactor->copy;
+    std::vector<RetainedCommit>& commits = compactor->commits;
+    int from = copy.headVersion();
+    int to = compactor->version;
+
+    // A commit gets its payload when it is inserted and node copies share it, so the nodes are in
+    // payload order and a payload past every one seen before marks the insert
+    size_t known = commits.size();   // commits already in the copy, the ones added below are new
+    for (; compactor->nodesScanned < compactor->nodesThrough; compactor->nodesScanned++) {
+        const CommitNode& node = source.nodes.nodes[compactor->nodesScanned];
+        if (node.payload < compactor->nextPayload) continue;
+        compactor->nextPayload = node.payload + 1;
+        RetainedCommit commit = { node.commitCounter, node.payload, node.version, INT_MAX };
+        commits.push_back(commit);
+    }
+
+    // A commit is in one unbroken run of versions, so the first version without it can be bisected.
+    // The count says how many are gone by to; looking from the newest commit back, which is where a
+    // rollback removes them, the search usually stops long before it went over every commit.
+    auto present = [&](const RetainedCommit& commit, int version) {
+        const CommitNode* node = searchCommit(snapshot(source, version), commit.commitCounter);
+        return node != nullptr && node->payload == commit.payload;
+    };
+    std::vector<size_t> changed;   // commits inserted or removed after from
+    for (size_t i = known; i < commits.size(); i++) changed.push_back(i);
+    int removed = (int)commits.size() - commitCount(snapshot(source, to));
+    int missing = removed;
+    for (size_t i = commits.size(); i-- > 0 && missing > 0;) {
+        RetainedCommit& commit = commits[i];
+        if (present(commit, to)) continue;
+        missing--;
+        if (i < known) changed.push_back(i);
+        int lo = std::max(commit.inserted, from);
+        int hi = to;
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (present(commit, mid)) lo = mid;
+            else hi = mid;
+        }
+        commit.removed = hi;
+    }
+
+    std::vector<int> kept;
+    for (int version = from + 1; version <= to; version++)
+        if (from > 0 || retainsVersion(compactor->retention, version, to)) kept.push_back(version);
+
+    // Each commit goes in at the first kept version it is in and out at the first one it is not.
+    // One inserted and removed between two kept versions never shows up at all.
+    std::vector<std::vector<int>> removals(kept.size());
+    std::vector<std::vector<std::pair<int, uint32_t>>> inserts(kept.size());
+    for (size_t i : changed) {
+        const RetainedCommit& commit = commits[i];
+        size_t out = std::lower_bound(kept.begin(), kept.end(), commit.removed) - kept.begin();
+        if (commit.inserted > from) {
+            size_t in = std::lower_bound(kept.begin(), kept.end(), commit.inserted) - kept.begin();
+            if (in == out) continue;
+            inserts[in].emplace_back(commit.commitCounter, commit.payload);
+        }
+        if (out < kept.size()) removals[out].push_back(commit.commitCounter);
+    }
+
+    beginUpdate(copy, to);   // a copy mapped from an image is marked like any update
+    for (size_t i = 0; i < kept.size(); i++) {
+        int version = kept[i];
+        while (copy.headVersion() < version - 1)
+            copy.versionRoots.push_back(copy.root);
+
+        for (int commitCounter : removals[i])
+            removeCommit(copy, commitCounter, version);
+        copy.rightmost = newestNode(copy.nodes, copy.root, version);
+
+        std::sort(inserts[i].begin(), inserts[i].end());
+        for (const std::pair<int, uint32_t>& insert : inserts[i]) {
+            const CommitPayload& payload = source.payloads.payloads[insert.second];
+            const StringPool& strings = source.payloads.strings;
+            copy.stats.commits++;
+            attachCommit(copy, insert.first, copy.payloads.add(strings.get(payload.fileName),
+                strings.get(payload.diffData), strings.get(payload.commitMessage)), version);
+        }
+        publishVersion(copy, version);
+    }
+    while (copy.headVersion() < to)
+        copy.versionRoots.push_back(copy.root);
+
+    if (removed > 0) {
+        commits.erase(std::remove_if(commits.begin(), commits.end(),
+            [](const RetainedCommit& commit) { return commit.removed != INT_MAX; }), commits.end());
+    }
+    compactor->versionsKept += (int)kept.size();
+
+    // Writing the whole copy out is the slow part of saving it, so it happens here and not on install
+    if (save && !copy.image) {
+        CommitTree* mapped = save(copy);
+        if (mapped != nullptr) compactor->copy.reset(mapped);
+    }
+    compactor->finished.store(true, std::memory_order_release);
+}
+
+
+// Starts a worker: a follow-up run when the copy is behind the head, otherwise a new compaction once
+// keepRecent versions were added since the last one, so the versions it kept in full fell out of the window.
+// A tree with branches is left alone, they share nodes of main line versions the copy would drop.
+void startCompaction(CommitCompactor& compactor, CommitTreePublisher& publisher) {
+    CommitTree& tree = publisher.writable();
+    if (tree.branches.size() > 1) return;
+    uint64_t epoch = publisher.epochs.epoch.load();
+    if (!compactor.copy) {
+        int since = (compactor.compactedEpoch == epoch) ? compactor.compactedAt : 0;
+        if (tree.headVersion() - since <= std::max(compactor.retention.keepRecent, 1)) return;
+        compactor.copy.reset(new CommitTree);
+        compactor.commits.clear();
+        compactor.nodesScanned = 0;
+        compactor.nextPayload = 0;
+        compactor.versionsKept = 0;
+    }
+
+    compactor.epoch = epoch;
+    compactor.version = tree.headVersion();
+    compactor.nodesThrough = (uint32_t)tree.nodes.nodeCount();
+    compactor.finished.store(false);
+    compactor.worker = std::thread(compactCommits, &compactor, new CommitReadGuard(publisher), compactor.save);
+}
+
+
+// Swaps in a copy that caught up with the head. Returns false when it is still behind, or was dropped
+// because the tree was replaced or branched meanwhile.
+bool installCompaction(CommitCompactor& compactor, CommitTreePublisher& publisher) {
+    if (publisher.epochs.epoch.load() != compactor.epoch || publisher.writable().branches.size() > 1) {
+        compactor.copy.reset();
+        return false;
+    }
+    const CommitTree& tree = publisher.writable();
+    int head = tree.headVersion();
+    if (compactor.copy->headVersion() < head) return false;
+
+    CompactionReport report;
+    report.bytesBefore = commitTreeBytes(tree);
+    report.bytesAfter = commitTreeBytes(*compactor.copy);
+    report.versionsKept = compactor.versionsKept;
+    report.versionsDropped = head - compactor.versionsKept;
+    compactor.report = report;
+
+    // The old tree may be freed right here when no reader holds it
+    publishCommitTree(publisher, compactor.copy.release());
+    compactor.commits.clear();
+    compactor.compactedEpoch = publisher.epochs.epoch.load();
+    compactor.compactedAt = head;
+    return true;
+}
+
+
+// Adds the versions published while the worker ran to its finished copy, on the writer thread. The
+// writer publishes a version before every call, so without this a copy would always be one behind
+// when it gets installed. Only the commits those versions inserted and removed are looked at, so this
+// costs O(k log v log n) for k of them, the work the writer did since the worker started. A copy the
+// worker saved gets them in its mapped image, the same as any update to a mapped tree.
+void catchUpCompaction(CommitCompactor& compactor, CommitTreePublisher& publisher) {
+    const CommitTree& tree = publisher.writable();
+    if (!compactor.copy || publisher.epochs.epoch.load() != compactor.epoch || tree.branches.size() > 1) return;
+    if (compactor.copy->headVersion() >= tree.headVersion()) return;
+    compactor.version = tree.headVersion();
+    compactor.nodesThrough = (uint32_t)tree.nodes.nodeCount();
+    compactCommits(&compactor, new CommitReadGuard(publisher), nullptr);
+}
+
+
+// Writer side of the compaction stage, call after every update. Installs a finished copy once it
+// caught up with the head, or sends the worker after the versions published since it started; never
+// waits for the worker.
+void compactCommitHistory(CommitCompactor& compactor, CommitTreePublisher& publisher) {
+    if (compactor.worker.joinable()) {
+        if (!compactor.finished.load(std::memory_order_acquire)) return;
+        compactor.worker.join();
+        catchUpCompaction(compactor, publisher);
+        if (installCompaction(compactor, publisher)) return;
+    }
+    startCompaction(compactor, publisher);
+}
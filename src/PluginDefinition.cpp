@@ -29,6 +29,8 @@
 #include <sstream>
 #include <shlobj.h>
 #include "CommitTree.h"
+#include "CommitImage.h"
+#include "CommitPack.h"
 #include <commctrl.h>
 #include <stdexcept>
 
@@ -42,28 +44,39 @@
 
 HINSTANCE g_hInst = NULL;
 std::wstring g_repoPath = L"F:\\CSI5610\\Repo";
-std::shared_ptr<CommitNode> g_commitTree = nullptr;
+CommitTreePublisher g_commitTrees;   // worker threads read it through a CommitReadGuard
+CommitFreezer g_commitFreezer;       // moves old history out of the tree in the background
+// Keeps the last 256 versions and every 64th one before them (see CompactCommitHistory)
+CommitCompactor g_commitCompactor(CommitRetention{ 256, 64 });
+CommitPack g_commitPack;             // snapshot, diff summary and message of every commit
 int g_commitCounter = 1;
+int g_commitImage = 0;               // which of the repo's two images (CommitImagePath) the tree is mapped from
 static wchar_t g_commitMsgBuffer[512] = { 0 };
+// The commit viewer shows this many lines first and the rest of the commit once it has painted
+const size_t VIEW_FIRST_SCREEN_LINES = 200;
+const UINT_PTR VIEW_REST_TIMER = 1;
 HWND g_hFileListDlg = NULL;
 
 
 struct TimelineData {
     std::vector<CommitInfo> commits;
-    std::wstring folderPath;
 };
 
 
 struct ViewCommitContext {
     int currentCommit;           // The commit number currently displayed.
-    std::wstring repoPath;       // The repository folder path.
 };
 
 
 // Function Declerations
 void InitializeCommitTree(const std::wstring& repoFolder);
 INT_PTR CALLBACK ViewOnlyDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
-void viewCommitInReadOnlyDialog(const std::wstring& fullPath);
+void viewCommitInReadOnlyDialog(int commitNum);
+std::string ReadCommitSnapshot(int commitNum);
+std::string ReadCommitLines(int commitNum, size_t firstLine, size_t lineCount);
+void ShowViewedCommit(HWND hDlg, int commitNum);
+std::string Utf8FromWide(const std::wstring& text);
+void CompactCommitHistory();
 std::wstring computeDiffSummary(const std::string& oldText, const std::string& newText);
 std::wstring promptForCommitMessage();
 static INT_PTR CALLBACK CommitMessageDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
@@ -319,14 +332,12 @@ INT_PTR CALLBACK TimelineDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
             {
                 // Get the commit details
                 auto commitPair = pData->commits[sel];
-                std::wstring commitFileName = commitPair.fileName;
-                std::wstring fullPath = pData->folderPath + L"\\" + commitFileName;
 
                 // Check if this is the newest commit:
                 if (commitPair.commitNumber == g_commitCounter - 1)
                 {
                     // Load the newest commit directly into Notepad++
-                    std::string fileContents = ReadFileAsString(fullPath);
+                    std::string fileContents = ReadCommitSnapshot(commitPair.commitNumber);
                     int which = -1;
                     ::SendMessage(nppData._nppHandle, NPPM_GETCURRENTSCINTILLA, 0, (LPARAM)&which);
                     if (which != -1)
@@ -342,7 +353,7 @@ INT_PTR CALLBACK TimelineDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
                 else
                 {
                     // For an older commit, open it in the view-only dialog.
-                    viewCommitInReadOnlyDialog(fullPath);
+                    viewCommitInReadOnlyDialog(commitPair.commitNumber);
                 }
             }
             return TRUE;
@@ -364,10 +375,16 @@ INT_PTR CALLBACK ViewOnlyDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
     if (message == WM_INITDIALOG) {
         SetWindowLongPtr(hDlg, GWLP_USERDATA, lParam);
         ViewCommitContext* pContext = reinterpret_cast<ViewCommitContext*>(lParam);
-        // Load and display the current commit file.
-        std::wstring commitFileName = L"commit_" + std::to_wstring(pContext->currentCommit) + L".txt";
-        std::wstring fullPath = pContext->repoPath + L"\\" + commitFileName;
-        std::string fileContents = ReadFileAsString(fullPath);
+        // Load and display the current commit.
+        ShowViewedCommit(hDlg, pContext->currentCommit);
+        return TRUE;
+    }
+
+    if (message == WM_TIMER && wParam == VIEW_REST_TIMER) {
+        // The first screen has painted, now show the whole commit.
+        KillTimer(hDlg, VIEW_REST_TIMER);
+        ViewCommitContext* pContext = reinterpret_cast<ViewCommitContext*>(GetWindowLongPtr(hDlg, GWLP_USERDATA));
+        std::string fileContents = ReadCommitSnapshot(pContext->currentCommit);
 
         // Convert UTF-8 file content to wide string.
         int size_needed = MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, NULL, 0);
@@ -386,33 +403,19 @@ INT_PTR CALLBACK ViewOnlyDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
         switch (LOWORD(wParam)) {
         case IDC_PREV:
         {
-            auto pred = getPredecessor(g_commitTree, pContext->currentCommit, g_commitCounter - 1);
+            auto pred = getPredecessor(g_commitTrees.writable(), pContext->currentCommit, g_commitTrees.writable().headVersion());
             if (pred) {
                 pContext->currentCommit = pred->commitCounter;
-                std::wstring commitFileName = L"commit_" + std::to_wstring(pContext->currentCommit) + L".txt";
-                std::wstring fullPath = pContext->repoPath + L"\\" + commitFileName;
-                std::string fileContents = ReadFileAsString(fullPath);
-                int size_needed = MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, NULL, 0);
-                std::wstring wcontent(size_needed, 0);
-                MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, &wcontent[0], size_needed);
-                HWND hEdit = GetDlgItem(hDlg, IDC_VIEW_EDIT);
-                SetWindowText(hEdit, wcontent.c_str());
+                ShowViewedCommit(hDlg, pContext->currentCommit);
             }
             return TRUE;
         }
         case IDC_NEXT:
         {
-            auto succ = getSuccessor(g_commitTree, pContext->currentCommit, g_commitCounter - 1);
+            auto succ = getSuccessor(g_commitTrees.writable(), pContext->currentCommit, g_commitTrees.writable().headVersion());
             if (succ) {
                 pContext->currentCommit = succ->commitCounter;
-                std::wstring commitFileName = L"commit_" + std::to_wstring(pContext->currentCommit) + L".txt";
-                std::wstring fullPath = pContext->repoPath + L"\\" + commitFileName;
-                std::string fileContents = ReadFileAsString(fullPath);
-                int size_needed = MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, NULL, 0);
-                std::wstring wcontent(size_needed, 0);
-                MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, &wcontent[0], size_needed);
-                HWND hEdit = GetDlgItem(hDlg, IDC_VIEW_EDIT);
-                SetWindowText(hEdit, wcontent.c_str());
+                ShowViewedCommit(hDlg, pContext->currentCommit);
             }
             return TRUE;
         }
@@ -425,35 +428,28 @@ INT_PTR CALLBACK ViewOnlyDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
             if (confirm == IDYES) {
                 int rollbackCommit = pContext->currentCommit;
 
-                // Delete all commit files with commit numbers greater than the currently viewed commit.
-                for (int i = rollbackCommit + 1; i < g_commitCounter; i++) {
-                    std::wstring commitFileName = L"commit_" + std::to_wstring(i) + L".txt";
-                    std::wstring fullPath = g_repoPath + L"\\" + commitFileName;
-                    _wremove(fullPath.c_str());
-
-                    std::wstring diffFileName = L"commit_" + std::to_wstring(i) + L".diff";
-                    std::wstring diffFullPath = g_repoPath + L"\\" + diffFileName;
-                    _wremove(diffFullPath.c_str());
-
-                    std::wstring msgFileName = L"commit_" + std::to_wstring(i) + L".msg";
-                    std::wstring msgFullPath = g_repoPath + L"\\" + msgFileName;
-                    _wremove(msgFullPath.c_str());
+                // Cut all commits newer than the currently viewed commit off the end of the pack.
+                // When that fails nothing else is touched, so the history still matches the pack.
+                if (!truncateCommitPack(g_commitPack, rollbackCommit)) {
+                    MessageBox(hDlg, L"Error removing the newer commits from the pack file.", L"Rollback Error", MB_OK);
+                    return TRUE;
                 }
 
                 // Update the commit counter so that it is one more than the rollback commit.
                 g_commitCounter = rollbackCommit + 1;
 
-                // Reinitialize the commit tree from the repository (only the remaining commits will be loaded).
-                InitializeCommitTree(g_repoPath);
+                // Drop the removed commits from the in-memory history as a new version, no rescan needed.
+                truncateCommits(g_commitTrees.writable(), rollbackCommit);
+                syncCommitImage(g_commitTrees.writable(), rollbackCommit);
+                CompactCommitHistory();
+                freezeCommitHistory(g_commitFreezer, g_commitTrees);
 
                 // Load the rollback commit into Notepad++.
                 int which = -1;
                 ::SendMessage(nppData._nppHandle, NPPM_GETCURRENTSCINTILLA, 0, (LPARAM)&which);
                 if (which != -1) {
                     HWND curScintilla = (which == 0) ? nppData._scintillaMainHandle : nppData._scintillaSecondHandle;
-                    std::wstring commitFileName = L"commit_" + std::to_wstring(rollbackCommit) + L".txt";
-                    std::wstring fullPath = g_repoPath + L"\\" + commitFileName;
-                    std::string fileContents = ReadFileAsString(fullPath);
+                    std::string fileContents = ReadCommitSnapshot(rollbackCommit);
                     ::SendMessage(curScintilla, SCI_SETTEXT, 0, (LPARAM)fileContents.c_str());
                 }
 
@@ -488,19 +484,11 @@ INT_PTR CALLBACK ViewOnlyDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 
 
 // Function that handles view commits window
-void viewCommitInReadOnlyDialog(const std::wstring& fullPath)
+void viewCommitInReadOnlyDialog(int commitNum)
 {
-    size_t pos1 = fullPath.find(L"commit_");
-    if (pos1 == std::wstring::npos) return;
-    size_t pos2 = fullPath.find(L".txt", pos1);
-    if (pos2 == std::wstring::npos) return;
-    std::wstring numberStr = fullPath.substr(pos1 + 7, pos2 - (pos1 + 7));
-    int commitNum = _wtoi(numberStr.c_str());
-
     // Allocate and initialize the context.
     ViewCommitContext* pContext = new ViewCommitContext;
     pContext->currentCommit = commitNum;
-    pContext->repoPath = g_repoPath;
 
     DialogBoxParam(
         g_hInst,
@@ -516,7 +504,8 @@ void viewCommitInReadOnlyDialog(const std::wstring& fullPath)
 void openVersionedFile()
 {
     // If no commits exist, notify the user.
-    if (!g_commitTree)
+    CommitTree& tree = g_commitTrees.writable();
+    if (tree.empty())
     {
         ::MessageBox(NULL, TEXT("No commits available."), TEXT("Info"), MB_OK);
         return;
@@ -524,11 +513,9 @@ void openVersionedFile()
 
     // Build a vector of commit pairs (commit number and filename) by in-order traversal.
     std::vector<CommitInfo> commitList;
-    for (int i = 1; i < g_commitCounter; i++) {
-        auto node = searchCommit(g_commitTree, i, g_commitCounter - 1);
-        if (node) {
-            commitList.push_back({ node->commitCounter, node->fileName, node->diffData, node->commitMessage });
-        }
+    CommitSnapshot head = snapshot(tree, tree.headVersion());
+    for (CommitIterator it = commitBegin(head); it.valid(); it.next()) {
+        commitList.push_back(getCommitInfo(tree, it.current()));
     }
     if (commitList.empty())
     {
@@ -539,7 +526,6 @@ void openVersionedFile()
     // Prepare timeline data to pass to the dialog.
     TimelineData timelineData;
     timelineData.commits = commitList;
-    timelineData.folderPath = g_repoPath;
 
     // Display the dialog
     DialogBoxParam(
@@ -581,7 +567,6 @@ void setRepoLocation()
     {
         g_repoPath = chosenFolder;
         SaveRepoPath(chosenFolder);
-        g_commitTree = nullptr;
         InitializeCommitTree(g_repoPath);
         std::wstring msg = L"Repository location set to:\n" + chosenFolder;
         ::MessageBox(NULL, msg.c_str(), L"Repository Location", MB_OK);
@@ -611,9 +596,8 @@ void commitCurrentFile() {
     std::string currentFileText(textBuffer, textLength);
     delete[] textBuffer;
 
-    // calculate the file names for the new and previous commit.
+    // the name the new commit is listed under
     std::wstring commitFileName = L"commit_" + std::to_wstring(g_commitCounter) + L".txt";
-    std::wstring fullPath = g_repoPath + L"\\" + commitFileName;
 
     // handle commit message
     std::wstring commitMessage = promptForCommitMessage();
@@ -625,60 +609,24 @@ void commitCurrentFile() {
     // Very basic diff generation (Will eventually replace this with an actual diffing library)
     std::wstring diffSummary = L"";
     if (g_commitCounter > 1) {
-        std::wstring prevCommitFileName = L"commit_" + std::to_wstring(g_commitCounter - 1) + L".txt";
-        std::wstring prevFullPath = g_repoPath + L"\\" + prevCommitFileName;
-        std::string prevFileText = ReadFileAsString(prevFullPath);
+        std::string prevFileText = ReadCommitSnapshot(g_commitCounter - 1);
         diffSummary = computeDiffSummary(prevFileText, currentFileText);
     }
 
-    FILE* fp = _wfopen(fullPath.c_str(), L"wb");
-    if (!fp) {
-        ::MessageBox(NULL, TEXT("Error writing commit file."), TEXT("Commit Error"), MB_OK);
+    // The chunks of the file contents no earlier commit had go to the end of the pack, in a single
+    // write with the diff summary and message
+    if (!appendPackedCommit(g_commitPack, g_commitCounter, currentFileText, Utf8FromWide(diffSummary), Utf8FromWide(commitMessage))) {
+        ::MessageBox(NULL, TEXT("Error writing commit to the pack file."), TEXT("Commit Error"), MB_OK);
         return;
     }
-    fwrite(currentFileText.c_str(), sizeof(char), currentFileText.size(), fp);
-    fclose(fp);
-
-    // Create the diff file name (e.g., commit_3.diff) and full path.
-    std::wstring diffFileName = L"commit_" + std::to_wstring(g_commitCounter) + L".diff";
-    std::wstring diffFullPath = g_repoPath + L"\\" + diffFileName;
-
-    // Convert diffSummary (std::wstring) to a UTF-8 std::string.
-    int size_needed = WideCharToMultiByte(CP_UTF8, 0, diffSummary.c_str(), -1, nullptr, 0, nullptr, nullptr);
-    std::string diffSummaryStr(size_needed, 0);
-    WideCharToMultiByte(CP_UTF8, 0, diffSummary.c_str(), -1, &diffSummaryStr[0], size_needed, nullptr, nullptr);
-
-    // Write the diff to the diff file.
-    FILE* diff_fp = _wfopen(diffFullPath.c_str(), L"wb");
-    if (diff_fp) {
-        fwrite(diffSummaryStr.c_str(), sizeof(char), diffSummaryStr.size(), diff_fp);
-        fclose(diff_fp);
-    }
-    else {
-        ::MessageBox(NULL, TEXT("Error writing diff file."), TEXT("Commit Error"), MB_OK);
-    }
-
-    // Create a file name for the commit message, e.g., commit_3.msg:
-    std::wstring msgFileName = L"commit_" + std::to_wstring(g_commitCounter) + L".msg";
-    std::wstring msgFullPath = g_repoPath + L"\\" + msgFileName;
-    FILE* msg_fp = _wfopen(msgFullPath.c_str(), L"wb");
-    if (msg_fp) {
-        // Convert the commit message (std::wstring) to UTF-8 std::string
-        int msg_size_needed = WideCharToMultiByte(CP_UTF8, 0, commitMessage.c_str(), -1, nullptr, 0, nullptr, nullptr);
-        std::string commitMessageStr(msg_size_needed, 0);
-        WideCharToMultiByte(CP_UTF8, 0, commitMessage.c_str(), -1, &commitMessageStr[0], msg_size_needed, nullptr, nullptr);
-
-        // Write the commit message (without the null terminator)
-        fwrite(commitMessageStr.c_str(), sizeof(char), commitMessageStr.size() - 1, msg_fp);
-        fclose(msg_fp);
-    }
-    else {
-        ::MessageBox(NULL, TEXT("Error writing commit message file."), TEXT("Commit Error"), MB_OK);
-    }
 
     // Insert the new commit into the persistent AVL tree
-    g_commitTree = insertNode(g_commitTree, g_commitCounter, commitFileName, diffSummary, commitMessage);
+    insertNode(g_commitTrees.writable(), g_commitCounter, commitFileName, diffSummary, commitMessage);
+    syncCommitImage(g_commitTrees.writable(), g_commitCounter);
     g_commitCounter++;
+    CompactCommitHistory();
+    freezeCommitHistory(g_commitFreezer, g_commitTrees);
+    reclaimCommitTrees(g_commitTrees);
 
 
     std::wstring msg = L"File committed as " + commitFileName;
@@ -687,6 +635,16 @@ void commitCurrentFile() {
 }
 
 
+// UTF-8 bytes of a wide string, without a terminating null
+std::string Utf8FromWide(const std::wstring& text) {
+    if (text.empty()) return std::string();
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), nullptr, 0, nullptr, nullptr);
+    std::string utf8(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &utf8[0], size_needed, nullptr, nullptr);
+    return utf8;
+}
+
+
 // Basic function for generating a diff summary, will eventually replace this with actual diffing
 std::wstring computeDiffSummary(const std::string& oldText, const std::string& newText) {
     std::istringstream oldStream(oldText);
@@ -711,45 +669,225 @@ std::wstring computeDiffSummary(const std::string& oldText, const std::string& n
 }
 
 
-// Parse the repo folder and populate the commit tree for the current Notepad++ session
-void InitializeCommitTree(const std::wstring& repoFolder)
+// Path of one of the two saved commit tree images inside a repo folder. A compacted tree is saved to
+// the one the current tree is not mapped from, as a mapped file cannot be replaced.
+std::wstring CommitImagePath(const std::wstring& repoFolder, int which)
+{
+    return repoFolder + (which == 0 ? L"\\commits.img" : L"\\commits.1.img");
+}
+
+
+// Path of the pack file holding every commit of a repo folder
+std::wstring CommitPackPath(const std::wstring& repoFolder)
+{
+    return repoFolder + L"\\commits.pack";
+}
+
+
+// Contents of a commit as it was committed, empty if the pack does not have it
+std::string ReadCommitSnapshot(int commitNum)
+{
+    std::string fileContents;
+    readPackedSnapshot(g_commitPack, commitNum, fileContents);
+    return fileContents;
+}
+
+
+// The lines of a commit from firstLine on (the first line being 0), reading only the part of the pack
+// they are in
+std::string ReadCommitLines(int commitNum, size_t firstLine, size_t lineCount)
+{
+    std::string fileContents;
+    readPackedLines(g_commitPack, commitNum, firstLine, lineCount, fileContents);
+    return fileContents;
+}
+
+
+// Shows the first screen of a commit in the view-only dialog right away. A timer brings in the whole
+// commit; its message only comes once nothing else is waiting, so the first screen paints before that.
+void ShowViewedCommit(HWND hDlg, int commitNum)
+{
+    std::string fileContents = ReadCommitLines(commitNum, 0, VIEW_FIRST_SCREEN_LINES);
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, NULL, 0);
+    std::wstring wcontent(size_needed, 0);
+    MultiByteToWideChar(CP_UTF8, 0, fileContents.c_str(), -1, &wcontent[0], size_needed);
+    HWND hEdit = GetDlgItem(hDlg, IDC_VIEW_EDIT);
+    SetWindowText(hEdit, wcontent.c_str());
+    SetTimer(hDlg, VIEW_REST_TIMER, 0, NULL);
+}
+
+
+// Saves a compacted copy to an image and maps it back, on the compactor's worker thread. The image is
+// marked stale until the copy is swapped in and synced, as the writer still updates the tree's own image.
+CommitTree* SaveCompactedCopy(const CommitTree& copy, const std::wstring& imagePath)
+{
+    CommitSnapshot head = snapshot(copy, copy.headVersion());
+    int count = commitCount(head);
+    int newestCommit = (count > 0) ? selectCommit(head, count)->commitCounter : 0;
+    if (!writeCommitImage(copy, imagePath, newestCommit)) return nullptr;
+
+    CommitTree* mapped = new CommitTree;
+    int lastCommit = 0;
+    if (!openCommitImage(*mapped, imagePath, lastCommit)) {
+        delete mapped;
+        return nullptr;
+    }
+    mapped->image->header->lastCommit = -1;
+    return mapped;
+}
+
+
+// Shows what the last compaction freed in the status bar. Notepad++ puts its own text back in that part
+// once another document is shown.
+void ShowCompactionReport(const CompactionReport& report)
+{
+    std::wstringstream wss;
+    wss << L"History compacted: " << report.versionsKept << L" versions kept, " << report.versionsDropped
+        << L" dropped, " << report.bytesReclaimed() / 1024 << L" KB freed";
+    std::wstring text = wss.str();
+    ::SendMessage(nppData._nppHandle, NPPM_SETSTATUSBAR, STATUSBAR_DOC_TYPE, (LPARAM)text.c_str());
+}
+
+
+// Compacts the history in the background. The worker saves its copy to the image the tree is not mapped
+// from, so once the copy is swapped in here only that image's header is left to bring up to date. The
+// image it replaced is marked stale so the next start does not take it for current.
+void CompactCommitHistory()
+{
+    const CommitTree* before = &g_commitTrees.writable();
+    std::shared_ptr<CommitImage> image = before->image;
+    std::wstring spareImage = CommitImagePath(g_repoPath, 1 - g_commitImage);
+    g_commitCompactor.save = [spareImage](const CommitTree& copy) { return SaveCompactedCopy(copy, spareImage); };
+    compactCommitHistory(g_commitCompactor, g_commitTrees);
+    CommitTree& tree = g_commitTrees.writable();
+    if (&tree == before) return;
+
+    if (tree.image) {
+        g_commitImage = 1 - g_commitImage;
+        syncCommitImage(tree, g_commitCounter - 1);
+    }
+    if (image)
+        image->header->lastCommit = -1;
+    ShowCompactionReport(g_commitCompactor.report);
+}
+
+
+// Moves a repo still in the old layout (a commit_N.txt, .diff and .msg file per commit) into the empty
+// pack, and hands the commits to the caller in order. The old files are only deleted once every commit
+// made it into the pack; if one does not, the pack is removed again so the next start retries.
+bool MigrateLegacyCommits(const std::wstring& repoFolder, std::vector<CommitInfo>& commits)
 {
     // Get all text files from the repo folder.
     std::vector<std::wstring> files = GetTextFiles(repoFolder);
-    int maxCommit = 0;
+    std::vector<int> commitNums;
 
-    // Iterate through each file.
+    // Check if file name matches the pattern "commit_<number>.txt"
+    std::wstring prefix = L"commit_";
+    std::wstring suffix = L".txt";
     for (const auto& file : files)
     {
-        // Check if file name matches the pattern "commit_<number>.txt"
-        std::wstring prefix = L"commit_";
-        std::wstring suffix = L".txt";
         if (file.compare(0, prefix.size(), prefix) == 0 &&
             file.size() > prefix.size() + suffix.size() &&
             file.compare(file.size() - suffix.size(), suffix.size(), suffix) == 0)
         {
             std::wstring numStr = file.substr(prefix.size(), file.size() - prefix.size() - suffix.size());
-            int commitNum = _wtoi(numStr.c_str());
+            commitNums.push_back(_wtoi(numStr.c_str()));
+        }
+    }
+    if (commitNums.empty()) return true;
 
-            std::wstring diffFileName = L"commit_" + std::to_wstring(commitNum) + L".diff";
-            std::wstring diffFullPath = repoFolder + L"\\" + diffFileName;
-            std::string diffDataStr = ReadFileAsString(diffFullPath);
-            std::wstring diffData(diffDataStr.begin(), diffDataStr.end());
+    // FindFirstFile returns the files in name order (commit_1, commit_10, commit_2, ...), the pack wants them in commit order
+    std::sort(commitNums.begin(), commitNums.end());
+    for (int commitNum : commitNums)
+    {
+        std::wstring basePath = repoFolder + L"\\commit_" + std::to_wstring(commitNum);
+        std::string fileText = ReadFileAsString(basePath + L".txt");
+        std::string diffData = ReadFileAsString(basePath + L".diff");
+        std::string commitMsg = ReadFileAsString(basePath + L".msg");
+
+        // The .diff files were written with the string's terminating null
+        if (!diffData.empty() && diffData.back() == '\0') diffData.pop_back();
+        if (!appendPackedCommit(g_commitPack, commitNum, fileText, diffData, commitMsg))
+        {
+            closeCommitPack(g_commitPack);
+            DeleteFileW(CommitPackPath(repoFolder).c_str());
+            commits.clear();
+            return false;
+        }
+        commits.push_back({ commitNum, L"commit_" + std::to_wstring(commitNum) + L".txt", widenPackData(diffData), widenPackData(commitMsg) });
+    }
+
+    FlushFileBuffers(g_commitPack.file);
+    for (int commitNum : commitNums)
+    {
+        std::wstring basePath = repoFolder + L"\\commit_" + std::to_wstring(commitNum);
+        _wremove((basePath + L".txt").c_str());
+        _wremove((basePath + L".diff").c_str());
+        _wremove((basePath + L".msg").c_str());
+    }
+    return true;
+}
 
-            std::wstring msgFileName = L"commit_" + std::to_wstring(commitNum) + L".msg";
-            std::wstring msgFullPath = repoFolder + L"\\" + msgFileName;
-            std::string commitMsgStr = ReadFileAsString(msgFullPath);
-            std::wstring commitMsg(commitMsgStr.begin(), commitMsgStr.end());
 
-            // Insert into commit tree
-            g_commitTree = insertNode(g_commitTree, commitNum, file, diffData, commitMsg);
+// Open the repo's pack and populate the commit tree for the current Notepad++ session
+void InitializeCommitTree(const std::wstring& repoFolder)
+{
+    // Opening the pack reads it once from front to back and collects every commit for a rebuild.
+    // A repo without a pack yet is moved into a new one. Without a pack the history is unknown, so the
+    // tree and the images are left alone rather than replaced by an empty history.
+    std::wstring packPath = CommitPackPath(repoFolder);
+    bool newPack = GetFileAttributesW(packPath.c_str()) == INVALID_FILE_ATTRIBUTES;
+    std::vector<CommitInfo> commits;
+    if (!openCommitPack(g_commitPack, packPath, &commits)) {
+        ::MessageBox(NULL, TEXT("Error opening the commit pack file."), TEXT("Repository Error"), MB_OK);
+        return;
+    }
+    if (newPack && !MigrateLegacyCommits(repoFolder, commits)) {
+        ::MessageBox(NULL, TEXT("Error moving the commit files into the pack file."), TEXT("Repository Error"), MB_OK);
+        return;
+    }
+    int maxCommit = g_commitPack.lastCommit;
+
+    // Map the saved image when it covers exactly the commits in the pack, the tree then costs the same for any history length.
+    // Of the two images at most one is current, the other was left behind by a compaction.
+    CommitTree* tree = new CommitTree;
+    int lastCommit = 0;
+    for (int which = 0; which < 2; which++) {
+        if (openCommitImage(*tree, CommitImagePath(repoFolder, which), lastCommit) && lastCommit == maxCommit) {
+            publishCommitTree(g_commitTrees, tree);
+            g_commitImage = which;
+            g_commitCounter = lastCommit + 1;
+            CompactCommitHistory();
+            freezeCommitHistory(g_commitFreezer, g_commitTrees);
+            return;
+        }
+        tree->clear();
+    }
 
-            if (commitNum > maxCommit)
-                maxCommit = commitNum;
+    // Bulk-load the whole history at once instead of inserting commit by commit, the pack hands
+    // the commits out in commit order.
+    // Build the new tree off to the side and swap it in, readers still on the old one keep it alive.
+    // Save it as an image and switch to the mapped copy, so later commits keep the image current.
+    buildCommitTree(*tree, commits);
+    std::wstring imagePath = CommitImagePath(repoFolder, 0);
+    g_commitImage = 0;
+    DeleteFileW(CommitImagePath(repoFolder, 1).c_str());
+    if (writeCommitImage(*tree, imagePath, maxCommit)) {
+        CommitTree* mapped = new CommitTree;
+        if (openCommitImage(*mapped, imagePath, lastCommit)) {
+            delete tree;
+            tree = mapped;
+        }
+        else {
+            delete mapped;
         }
     }
+    publishCommitTree(g_commitTrees, tree);
+
     // Set the global commit counter to one more than the highest commit number.
     g_commitCounter = maxCommit + 1;
+    CompactCommitHistory();
+    freezeCommitHistory(g_commitFreezer, g_commitTrees);
 }
 
 